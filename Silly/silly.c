@@ -0,0 +1,6192 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <string.h>
+#include <math.h>
+#include <setjmp.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#include <llvm-c/Analysis.h>
+#include <llvm-c/BitReader.h>
+#include <llvm-c/BitWriter.h>
+#include <llvm-c/Core.h>
+#include <llvm-c/Error.h>
+#include <llvm-c/Linker.h>
+#include <llvm-c/LLJIT.h>
+#include <llvm-c/Orc.h>
+#include <llvm-c/Target.h>
+#include <llvm-c/TargetMachine.h>
+#include <llvm-c/Transforms/PassBuilder.h>
+
+#include "silly.h"
+
+#define READ_CHUNK_SIZE (256 * 1024)
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define EVAL_STACK_SIZE (64 * 1024)
+#define EVAL_MAX_DEPTH 10000
+#define SYMBOL_PAGE_BITS 10
+#define SYMBOL_PAGE_SIZE (1 << SYMBOL_PAGE_BITS)
+#define MAX_SYMBOL_PAGES 4096
+#define SYMBOL_CACHE_SIZE 4096
+#define ALLOC_STRUCT(name, structType) struct structType *name = \
+(struct structType *) ArenaAlloc(Ctx->CurArena, sizeof(struct structType))
+#define ALLOC_EXPR(name, structType, kind) ALLOC_STRUCT(name, structType); \
+name->Base.Kind = kind; name->Base.Type = type_f64; COUNT_NODE(kind)
+#define ALLOC_STRUCT_ARGS(name, structType, n) struct structType *name = \
+(struct structType *) ArenaAlloc(Ctx->CurArena, sizeof(struct structType) + \
+(n) * sizeof(((struct structType *) 0)->Args[0])); \
+name->NumArgs = n
+#define ALLOC_EXPR_ARGS(name, structType, kind, n) \
+ALLOC_STRUCT_ARGS(name, structType, n); \
+name->Base.Kind = kind; name->Base.Type = type_f64; COUNT_NODE(kind)
+#define COUNT_NODE(kind) if (Ctx->Stats) CountNode(kind)
+
+
+#pragma mark Arena allocation
+
+/// Arena - A bump allocator for AST nodes.  Allocations are carved out of
+/// large blocks and are never freed individually; the whole arena is either
+/// reset once its contents are no longer needed, or rolled back to a mark.
+struct ArenaBlock {
+    struct ArenaBlock *Prev;
+    size_t Size;
+    char Data[];
+};
+
+struct Arena {
+    struct ArenaBlock *Head; // Most recently allocated block.
+    char *Ptr, *End;         // Free space left in Head.
+};
+
+/// ArenaMark - A position in an arena that ArenaRelease can roll back to.
+struct ArenaMark {
+    struct ArenaBlock *Head;
+    char *Ptr;
+};
+
+#pragma mark Context
+
+/// silly_context - Everything one instance of the compiler works on: the
+/// source it is reading, the symbol and function tables, the evaluator and
+/// the JIT.  Each public entry point makes its context the current one, Ctx,
+/// for the calling thread, so separate contexts can be used from separate
+/// threads at the same time.  A context must not be used from two threads at
+/// once, apart from the batch compile workers it starts itself.
+struct silly_context {
+    enum silly_backend Backend;
+    int FlatAST;         // Set by --flat-ast; see FlattenFunction.
+    
+    // BatchMode - Set by -c.  No prompts or status messages are printed, and
+    // under the JIT every item goes into one module that is optimized and
+    // compiled as a whole once the input is exhausted.  Top-level expressions
+    // become __anon_expr.0, __anon_expr.1, ... and run in order at that point.
+    int BatchMode;
+    int NumBatchExprs;
+    int FirstBatchExpr;  // The first of them read by the current run.
+    unsigned char *BatchExprPure; // For each of those, with -j; see RunBatch.
+    int BatchExprCapacity;
+    int Interactive;     // Print prompts and status messages.
+    double *ResultOut;   // Where silly_eval wants top-level values, if set.
+    void (*OnResult)(void *, double); // Otherwise who does, if set.
+    void *ResultUser;
+    int NumErrors;       // Errors reported so far.
+    
+    // A parse worker collects its error messages in ErrorLog rather than
+    // printing them, so that they come out in source order; see RunFiles.
+    int LogErrors;
+    char *ErrorLog;
+    size_t ErrorLogLen, ErrorLogCapacity;
+    
+    // ItemArena holds everything parsed for the current top-level item; it
+    // is reset once the item has been handled.  PersistentArena holds
+    // declarations, which must outlive the item that introduced them.  Each
+    // definition gets an arena of its own instead, so that it can be freed
+    // when it is redefined; DefArena holds the one being parsed.
+    // ALLOC_STRUCT allocates from CurArena.
+    struct Arena ItemArena;
+    struct Arena PersistentArena;
+    struct Arena DefArena;
+    struct Arena *CurArena;
+    
+    // Symbol table, shared with the context's parse workers; see
+    // InternSymbol.  SymbolCache is a parse worker's own.
+    struct SymbolTable *Symbols;
+    int *SymbolCache;
+    
+    // Source buffer.
+    const char *CurPtr;    // Next byte the lexer will look at.
+    const char *BufferEnd; // One past the last byte of input read so far.
+    int SourceFD;          // Descriptor to refill from, -1 once exhausted.
+    char *ReadBuffer;
+    size_t ReadBufferSize;
+    void *SourceMap;       // The mapped source file, if any.
+    size_t SourceMapSize;
+    
+    // Push mode: input arrives in chunks through silly_push rather than
+    // being read, and running out of it abandons the item being parsed; see
+    // RunPushedItems.
+    int Pushing;
+    int PushEnded;         // silly_push_end has been called.
+    jmp_buf NeedInputJmp;  // Where the lexer goes when it needs more input.
+    
+    // Lexer and parser.
+    int IdentifierSym;     // Filled in if tok_identifier
+    double NumVal;         // Filled in if tok_number
+    int CurTok;
+    int SkipToken;         // Skip CurTok before the next item, after an error.
+    
+    // Scratch stacks the parser collects call arguments and prototype
+    // argument names and types on until it knows how many there are.  Nested
+    // calls stack their arguments on top of their caller's.
+    struct ExprAST **ArgStack;
+    int NumArgStack, ArgStackCapacity;
+    int *ParamBuf;
+    unsigned char *ParamTypeBuf;
+    int ParamBufCapacity;
+    int AnonExprSym;       // Name of the function wrapping a top-level expr.
+    
+    // BinopPrecedence - This holds the precedence for each binary operator
+    // that is defined, indexed directly by the operator character.  0 means
+    // the character is not a binary operator; new operators are installed by
+    // setting an entry.
+    int BinopPrecedence[256];
+    
+    // FunctionPages - Entries indexed by the symbol ID of the function name,
+    // paged like the symbols themselves so that entries never move.
+    // DefGeneration is bumped whenever any function is defined or redefined.
+    struct FunctionEntry *FunctionPages[MAX_SYMBOL_PAGES];
+    int DefGeneration;
+    int InlineThreshold;   // Set by --inline-threshold; 0 disables inlining.
+    int RefreshPass;       // Counts RefreshInlined passes.
+    
+    // Evaluator.
+    double EvalStack[EVAL_STACK_SIZE];
+    double *EvalSP;
+    int EvalDepth;
+    jmp_buf EvalErrorJmp;
+    
+    // Scratch buffers the bytecode compiler emits into; CompileFunction
+    // copies the finished function out into CurArena.
+    struct Instr *CodeBuf;
+    double *ConstBuf;
+    int *CalleeBuf;
+    int NumCode, NumConsts, NumCallees, MaxReg;
+    int CodeCapacity, ConstCapacity, CalleeCapacity;
+    
+    // JIT.  OptLevel is the -O level each module is optimized at before it is
+    // handed to the JIT; -O0 skips optimization for the fastest turnaround.
+    // UseCallSlots makes JIT'd code call defs through the NAME.slot pointer
+    // each one has rather than by their symbol, so that they can be
+    // redefined; batch mode builds everything into one module and calls
+    // directly, for inlining.
+    int OptLevel;
+    int UseCallSlots;
+    LLVMOrcThreadSafeContextRef TheTSContext;
+    LLVMOrcLLJITRef TheJIT;
+    LLVMOrcJITDylibRef MainJD;
+    const char *JITTriple, *JITDataLayout; // What modules are built for.
+    
+    // The code generator state of the thread using the context; see
+    // EnterContext.
+    LLVMContextRef MainContext;
+    LLVMModuleRef MainModule;
+    LLVMBuilderRef MainBuilder;
+    LLVMTypeRef MainDoubleTy;
+    LLVMTargetMachineRef MainTargetMachine;
+    
+    // Compile cache.
+    const char *CacheDir;
+    uint64_t CacheKeySeed; // Hash of CACHE_FORMAT and the target.
+    
+    // Ahead-of-time compilation.  EmitPath, set by --emit-obj or --emit-so,
+    // makes batch mode write its module to an object file, or link it into a
+    // shared library if EmitShared, instead of running it.
+    const char *EmitPath;
+    int EmitShared;
+    int FirstEmitError;    // NumErrors when the current source began.
+    
+    // Parallel compilation.
+    int NumJobs;
+    int UseCompileWorkers; // Batch mode JIT with NumJobs > 1.
+    struct CompileWorker *Workers;
+    pthread_mutex_t WorkLock;
+    pthread_cond_t WorkAvailable;
+    const struct FunctionAST **WorkQueue;
+    int WorkHead, WorkTail, WorkCapacity;
+    int WorkClosed;
+    
+    // Tiered execution; see TieredCode.  TierLock guards the queue for the
+    // tier-up thread and the code it has retired, DefLock the definitions it
+    // reads while generating code.
+    int TierThreshold;     // Set by --tier-threshold; 0 disables tiering.
+    int TierStarted;       // TierThread is running.
+    pthread_t TierThread;
+    pthread_mutex_t TierLock;
+    pthread_cond_t TierAvailable;
+    struct FunctionEntry **TierQueue;
+    int TierHead, TierTail, TierCapacity;
+    int TierClosed;
+    int NumTierUps;        // Compiled by TierThread, for unique names.
+    struct TierCode *TierRetired; // Replaced code for the main thread to free.
+    pthread_mutex_t DefLock;
+    
+    // Parallel front end; see RunFiles.  ParseLock guards the Done flags of
+    // the files.
+    struct ParsedFile *ParsedFiles;
+    int NumParsedFiles;
+    int NextParsedFile;    // The next one for a parse worker to take.
+    pthread_t *ParseWorkers;
+    int NumParseWorkers;
+    pthread_mutex_t ParseLock;
+    pthread_cond_t FileParsed;
+    
+    // IsPureFunction's walks, and the defs the current one has visited.
+    int PureWalk;
+    struct FunctionEntry **PureVisited;
+    int NumPureVisited, PureVisitedCapacity;
+    
+    struct Stats *Stats; // Collected for --stats, if set.
+};
+
+/// Ctx - The context this thread is working on.
+static __thread struct silly_context *Ctx;
+
+static void CountAlloc(size_t Size);
+
+static void *ArenaAlloc(struct Arena *A, size_t Size) {
+    Size = (Size + 15) & ~(size_t) 15;
+    if (Ctx->Stats) {
+        CountAlloc(Size);
+    }
+    if ((size_t) (A->End - A->Ptr) < Size) {
+        size_t BlockSize = Size > ARENA_BLOCK_SIZE ? Size : ARENA_BLOCK_SIZE;
+        struct ArenaBlock *Block = (struct ArenaBlock *)
+            malloc(sizeof(struct ArenaBlock) + BlockSize);
+        Block->Prev = A->Head;
+        Block->Size = BlockSize;
+        A->Head = Block;
+        A->Ptr = Block->Data;
+        A->End = Block->Data + BlockSize;
+    }
+    
+    void *Result = A->Ptr;
+    A->Ptr += Size;
+    return Result;
+}
+
+static struct ArenaMark ArenaGetMark(struct Arena *A) {
+    struct ArenaMark Mark = { A->Head, A->Ptr };
+    return Mark;
+}
+
+/// ArenaRelease - Free everything allocated since Mark was taken.
+static void ArenaRelease(struct Arena *A, struct ArenaMark Mark) {
+    while (A->Head != Mark.Head) {
+        struct ArenaBlock *Prev = A->Head->Prev;
+        free(A->Head);
+        A->Head = Prev;
+        A->End = Prev ? Prev->Data + Prev->Size : NULL;
+    }
+    A->Ptr = Mark.Ptr;
+}
+
+/// ArenaReset - Free everything in the arena, keeping its oldest block around
+/// for reuse so that a per-item arena does not go back to malloc every time.
+static void ArenaReset(struct Arena *A) {
+    if (!A->Head) {
+        return;
+    }
+    
+    struct ArenaBlock *First = A->Head;
+    while (First->Prev) {
+        First = First->Prev;
+    }
+    struct ArenaMark Mark = { First, First->Data };
+    ArenaRelease(A, Mark);
+}
+
+/// ArenaFree - Free everything in the arena, blocks and all.
+static void ArenaFree(struct Arena *A) {
+    struct ArenaMark Mark = { NULL, NULL };
+    ArenaRelease(A, Mark);
+}
+
+#pragma mark Symbol table
+
+/// Identifiers are interned as the lexer produces them: each distinct name is
+/// stored once and the AST refers to it by a small integer ID, so comparing
+/// two names is a single integer compare.
+///
+/// Symbols live in fixed-size pages that never move once allocated, so that
+/// compiler threads can read the names of symbols handed to them while the
+/// parsing thread keeps interning new ones.
+///
+/// While parse workers are running the table is Shared: it is only changed
+/// under its Lock, and each worker looks names up in a direct-mapped cache of
+/// its own first, so that the lock is only taken for names the worker has
+/// not seen before.
+struct Symbol {
+    const char *Name;
+    size_t Len;
+    unsigned Hash;
+};
+
+struct SymbolTable {
+    struct Symbol *Pages[MAX_SYMBOL_PAGES];
+    int NumSymbols;
+    int *Buckets;         // Open-addressed hash of IDs, -1 when empty.
+    unsigned NumBuckets;
+    struct Arena Names;   // Storage for the names themselves.
+    pthread_mutex_t Lock;
+    int Shared;
+};
+
+static unsigned HashName(const char *Name, size_t Len) {
+    unsigned Hash = 2166136261u; // FNV-1a
+    for (size_t i = 0; i < Len; i++) {
+        Hash = (Hash ^ (unsigned char) Name[i]) * 16777619u;
+    }
+    return Hash;
+}
+
+static struct Symbol *GetSymbol(int ID) {
+    struct SymbolTable *T = Ctx->Symbols;
+    return &T->Pages[ID >> SYMBOL_PAGE_BITS][ID & (SYMBOL_PAGE_SIZE - 1)];
+}
+
+static void GrowSymbolBuckets(struct SymbolTable *T) {
+    free(T->Buckets);
+    T->NumBuckets = T->NumBuckets ? T->NumBuckets * 2 : 1024;
+    T->Buckets = (int *) malloc(T->NumBuckets * sizeof(int));
+    memset(T->Buckets, -1, T->NumBuckets * sizeof(int));
+    
+    for (int ID = 0; ID < T->NumSymbols; ID++) {
+        unsigned i = GetSymbol(ID)->Hash & (T->NumBuckets - 1);
+        while (T->Buckets[i] >= 0) {
+            i = (i + 1) & (T->NumBuckets - 1);
+        }
+        T->Buckets[i] = ID;
+    }
+}
+
+/// AddSymbol - InternSymbol for a table that is not being changed by any
+/// other thread.
+static int AddSymbol(struct SymbolTable *T, const char *Name, size_t Len,
+                     unsigned Hash) {
+    if (2 * (unsigned) T->NumSymbols >= T->NumBuckets) {
+        GrowSymbolBuckets(T);
+    }
+    
+    unsigned i = Hash & (T->NumBuckets - 1);
+    for (int ID; (ID = T->Buckets[i]) >= 0; i = (i + 1) & (T->NumBuckets - 1)) {
+        struct Symbol *Sym = GetSymbol(ID);
+        if (Sym->Hash == Hash && Sym->Len == Len && !memcmp(Sym->Name, Name, Len)) {
+            return ID;
+        }
+    }
+    
+    int Page = T->NumSymbols >> SYMBOL_PAGE_BITS;
+    if (Page == MAX_SYMBOL_PAGES) {
+        fprintf(stderr, "Error: too many identifiers\n");
+        exit(1);
+    }
+    if (!T->Pages[Page]) {
+        T->Pages[Page] = (struct Symbol *)
+            malloc(SYMBOL_PAGE_SIZE * sizeof(struct Symbol));
+    }
+    
+    char *Copy = (char *) ArenaAlloc(&T->Names, Len + 1);
+    memcpy(Copy, Name, Len);
+    Copy[Len] = 0;
+    
+    struct Symbol *Sym = GetSymbol(T->NumSymbols);
+    Sym->Name = Copy;
+    Sym->Len = Len;
+    Sym->Hash = Hash;
+    T->Buckets[i] = T->NumSymbols;
+    return T->NumSymbols++;
+}
+
+/// InternSymbol - Return the ID for the name [Name, Name+Len), adding it to
+/// the table if it has not been seen before.
+static int InternSymbol(const char *Name, size_t Len) {
+    struct SymbolTable *T = Ctx->Symbols;
+    unsigned Hash = HashName(Name, Len);
+    if (!T->Shared) {
+        return AddSymbol(T, Name, Len, Hash);
+    }
+    
+    // Symbols never move, so a cached one can be checked without the lock.
+    int *Cached = Ctx->SymbolCache
+                      ? &Ctx->SymbolCache[Hash & (SYMBOL_CACHE_SIZE - 1)]
+                      : NULL;
+    if (Cached && *Cached) {
+        struct Symbol *Sym = GetSymbol(*Cached - 1);
+        if (Sym->Hash == Hash && Sym->Len == Len && !memcmp(Sym->Name, Name, Len)) {
+            return *Cached - 1;
+        }
+    }
+    pthread_mutex_lock(&T->Lock);
+    int ID = AddSymbol(T, Name, Len, Hash);
+    pthread_mutex_unlock(&T->Lock);
+    if (Cached) {
+        *Cached = ID + 1;
+    }
+    return ID;
+}
+
+/// SymbolName - The NUL-terminated spelling of an interned symbol.
+static const char *SymbolName(int ID) {
+    return GetSymbol(ID)->Name;
+}
+
+#pragma mark Source buffer
+
+/// The lexer scans the input through a plain character cursor rather than
+/// pulling bytes one at a time from stdio.  Regular files are mapped straight
+/// into memory; pipes and terminals are read through a large buffer that is
+/// refilled on demand.  Either way the byte at BufferEnd is always 0, so the
+/// scanning loops stop there without a separate bounds check.
+
+/// FillSource - Read more input once the lexer has reached BufferEnd.  The
+/// partially scanned token [*Start, BufferEnd) is kept at the front of the
+/// buffer, and *Start and *P are rebased onto it.  Returns 0 at end of input.
+/// In push mode there is nothing to read until the next chunk is pushed, so
+/// this abandons the current item instead unless the input has been ended.
+static int FillSource(const char **Start, const char **P) {
+    if (Ctx->Pushing && !Ctx->PushEnded) {
+        longjmp(Ctx->NeedInputJmp, 1);
+    }
+    if (Ctx->SourceFD < 0) {
+        return 0;
+    }
+    
+    size_t Kept = Ctx->BufferEnd - *Start;
+    size_t Offset = *P - *Start;
+    if (Kept + READ_CHUNK_SIZE + 1 > Ctx->ReadBufferSize) {
+        Ctx->ReadBufferSize = Kept + READ_CHUNK_SIZE + 1;
+        char *Old = Ctx->ReadBuffer;
+        Ctx->ReadBuffer = (char *) malloc(Ctx->ReadBufferSize);
+        memcpy(Ctx->ReadBuffer, *Start, Kept);
+        free(Old);
+    } else {
+        memmove(Ctx->ReadBuffer, *Start, Kept);
+    }
+    
+    ssize_t N;
+    do {
+        N = read(Ctx->SourceFD, Ctx->ReadBuffer + Kept,
+                 Ctx->ReadBufferSize - Kept - 1);
+    } while (N < 0 && errno == EINTR);
+    if (N <= 0) {
+        if (Ctx->SourceFD != STDIN_FILENO) {
+            close(Ctx->SourceFD);
+        }
+        Ctx->SourceFD = -1;
+        N = 0;
+    }
+    
+    Ctx->ReadBuffer[Kept + N] = 0;
+    Ctx->BufferEnd = Ctx->ReadBuffer + Kept + N;
+    *Start = Ctx->ReadBuffer;
+    *P = Ctx->ReadBuffer + Offset;
+    return N > 0;
+}
+
+/// ReleaseSource - Let go of the current source, if any.
+static void ReleaseSource() {
+    if (Ctx->SourceFD >= 0 && Ctx->SourceFD != STDIN_FILENO) {
+        close(Ctx->SourceFD);
+    }
+    if (Ctx->SourceMap) {
+        munmap(Ctx->SourceMap, Ctx->SourceMapSize);
+    }
+    free(Ctx->ReadBuffer);
+    Ctx->SourceFD = -1;
+    Ctx->SourceMap = NULL;
+    Ctx->ReadBuffer = NULL;
+    Ctx->CurPtr = Ctx->BufferEnd = NULL;
+    Ctx->Pushing = Ctx->PushEnded = 0;
+}
+
+/// InitSourceFD - Lex from a descriptor through the refillable read buffer.
+static void InitSourceFD(int FD) {
+    ReleaseSource();
+    Ctx->SourceFD = FD;
+    Ctx->ReadBufferSize = READ_CHUNK_SIZE + 1;
+    Ctx->ReadBuffer = (char *) malloc(Ctx->ReadBufferSize);
+    Ctx->ReadBuffer[0] = 0;
+    Ctx->CurPtr = Ctx->BufferEnd = Ctx->ReadBuffer;
+}
+
+/// InitSourceFile - Lex from the named file.  The file is mapped whenever its
+/// size leaves a zero-filled tail in the last page to serve as the sentinel;
+/// anything else falls back to reading.  Returns 0 if it cannot be opened.
+static int InitSourceFile(const char *Path) {
+    int FD = open(Path, O_RDONLY);
+    if (FD < 0) {
+        return 0;
+    }
+    ReleaseSource();
+    
+    struct stat St;
+    long PageSize = sysconf(_SC_PAGESIZE);
+    if (fstat(FD, &St) == 0 && S_ISREG(St.st_mode) && St.st_size > 0 &&
+        St.st_size % PageSize != 0) {
+        void *Map = mmap(NULL, St.st_size, PROT_READ, MAP_PRIVATE, FD, 0);
+        if (Map != MAP_FAILED) {
+            close(FD);
+            Ctx->SourceMap = Map;
+            Ctx->SourceMapSize = St.st_size;
+            Ctx->CurPtr = (const char *) Map;
+            Ctx->BufferEnd = Ctx->CurPtr + St.st_size;
+            return 1;
+        }
+    }
+    
+    InitSourceFD(FD);
+    return 1;
+}
+
+/// InitSourceString - Lex from a copy of the Len bytes at Str.
+static void InitSourceString(const char *Str, size_t Len) {
+    ReleaseSource();
+    Ctx->ReadBufferSize = Len + 1;
+    Ctx->ReadBuffer = (char *) malloc(Ctx->ReadBufferSize);
+    memcpy(Ctx->ReadBuffer, Str, Len);
+    Ctx->ReadBuffer[Len] = 0;
+    Ctx->CurPtr = Ctx->ReadBuffer;
+    Ctx->BufferEnd = Ctx->ReadBuffer + Len;
+}
+
+/// InitSourcePush - Lex from chunks handed to PushSource.
+static void InitSourcePush() {
+    InitSourceFD(-1);
+    Ctx->Pushing = 1;
+}
+
+/// PushSource - Append a chunk of input.  Everything before CurPtr has been
+/// lexed for good, so the rest is moved to the front of the buffer first.
+static void PushSource(const char *Chunk, size_t Len) {
+    size_t Kept = Ctx->BufferEnd - Ctx->CurPtr;
+    if (Kept + Len + 1 > Ctx->ReadBufferSize) {
+        Ctx->ReadBufferSize = 2 * Ctx->ReadBufferSize > Kept + Len + 1
+                                  ? 2 * Ctx->ReadBufferSize
+                                  : Kept + Len + 1;
+        char *Old = Ctx->ReadBuffer;
+        Ctx->ReadBuffer = (char *) malloc(Ctx->ReadBufferSize);
+        memcpy(Ctx->ReadBuffer, Ctx->CurPtr, Kept);
+        free(Old);
+    } else {
+        memmove(Ctx->ReadBuffer, Ctx->CurPtr, Kept);
+    }
+    
+    memcpy(Ctx->ReadBuffer + Kept, Chunk, Len);
+    Ctx->ReadBuffer[Kept + Len] = 0;
+    Ctx->CurPtr = Ctx->ReadBuffer;
+    Ctx->BufferEnd = Ctx->ReadBuffer + Kept + Len;
+}
+
+#pragma mark Lexer
+
+// The lexer returns tokens [0-255] if it is an unknown character, otherwise one
+// of these for known things.
+enum Token {
+    tok_eof = -1,
+    
+    // commands
+    tok_def = -2,
+    tok_extern = -3,
+    
+    // primary
+    tok_identifier = -4,
+    tok_number = -5,
+    
+    // control
+    tok_if = -6,
+    tok_then = -7,
+    tok_else = -8,
+    tok_for = -9,
+    tok_in = -10
+};
+
+/// KEYWORDS - The one table of reserved words and the tokens they lex as.
+/// InitKeywords interns them ahead of every other identifier, so a keyword's
+/// symbol ID is its index in this table and, once an identifier has been
+/// interned, recognizing a keyword is a single compare.
+#define KEYWORDS(X) \
+    X(def, tok_def) \
+    X(extern, tok_extern) \
+    X(if, tok_if) \
+    X(then, tok_then) \
+    X(else, tok_else) \
+    X(for, tok_for) \
+    X(in, tok_in)
+
+enum Keyword {
+#define X(Name, Tok) kw_##Name,
+    KEYWORDS(X)
+#undef X
+    NUM_KEYWORDS
+};
+
+static const int KeywordTokens[NUM_KEYWORDS] = {
+#define X(Name, Tok) Tok,
+    KEYWORDS(X)
+#undef X
+};
+
+/// TYPES - The names of the value types a prototype or loop variable can
+/// be annotated with, in order of rank: mixing two types in an operation
+/// gives the greater.  They are interned right after the keywords, so type
+/// T's symbol ID is NUM_KEYWORDS + T.  They are not reserved.
+#define TYPES(X) \
+    X(i64) \
+    X(f32) \
+    X(f64)
+
+enum ValueType {
+#define X(Name) type_##Name,
+    TYPES(X)
+#undef X
+    NUM_TYPES
+};
+
+static const char *const TypeNames[NUM_TYPES] = {
+#define X(Name) #Name,
+    TYPES(X)
+#undef X
+};
+
+static void InitKeywords() {
+#define X(Name, Tok) InternSymbol(#Name, sizeof(#Name) - 1);
+    KEYWORDS(X)
+#undef X
+#define X(Name) InternSymbol(#Name, sizeof(#Name) - 1);
+    TYPES(X)
+#undef X
+}
+
+/// Numbers are converted straight from the source buffer.  A literal's
+/// value is its digits M divided by 10^K, K being the number of digits after
+/// the point; as with strtod, a second point and anything after it is not
+/// part of it.  ScanNumber rounds M / 10^K to the nearest double with
+/// machine arithmetic when M has at most 19 significant digits and K is at
+/// most 27, and leaves anything longer to DecimalToDouble.
+
+/// Decimal - The digits D[0] D[1] ... of a number 0.D[0]D[1]... *
+/// 10^DecimalPoint, for DecimalToDouble.  Digits beyond MAX_DECIMAL_DIGITS
+/// are dropped, which Truncated records for rounding.  The digits never end
+/// in a 0.
+#define MAX_DECIMAL_DIGITS 800
+struct Decimal {
+    unsigned char D[MAX_DECIMAL_DIGITS];
+    int NumDigits;
+    int DecimalPoint;
+    int Truncated;
+};
+
+/// MAX_DECIMAL_SHIFT - The most DecimalShift moves by in one step: every
+/// digit times 2^60 plus a carry still fits in 64 bits.
+#define MAX_DECIMAL_SHIFT 60
+
+static void DecimalTrim(struct Decimal *A) {
+    while (A->NumDigits > 0 && A->D[A->NumDigits - 1] == 0) {
+        A->NumDigits--;
+    }
+    if (A->NumDigits == 0) {
+        A->DecimalPoint = 0;
+    }
+}
+
+/// DecimalRightShift - Divide A by 2^K, for K up to MAX_DECIMAL_SHIFT.
+static void DecimalRightShift(struct Decimal *A, int K) {
+    int R = 0, W = 0;
+    uint64_t N = 0;
+    
+    // Pick up enough leading digits to cover the first shift.
+    for (; N >> K == 0; R++) {
+        if (R >= A->NumDigits) {
+            while (N >> K == 0) {
+                N *= 10;
+                R++;
+            }
+            break;
+        }
+        N = N * 10 + A->D[R];
+    }
+    A->DecimalPoint -= R - 1;
+    
+    // Pick up a digit, put down a digit.
+    uint64_t Mask = ((uint64_t) 1 << K) - 1;
+    for (; R < A->NumDigits; R++) {
+        int Digit = (int) (N >> K);
+        N &= Mask;
+        A->D[W++] = Digit;
+        N = N * 10 + A->D[R];
+    }
+    
+    // Put down the digits left over.
+    while (N > 0) {
+        int Digit = (int) (N >> K);
+        N &= Mask;
+        if (W < MAX_DECIMAL_DIGITS) {
+            A->D[W++] = Digit;
+        } else if (Digit > 0) {
+            A->Truncated = 1;
+        }
+        N *= 10;
+    }
+    A->NumDigits = W;
+    DecimalTrim(A);
+}
+
+/// DecimalLeftShift - Multiply A by 2^K, for K up to MAX_DECIMAL_SHIFT.
+static void DecimalLeftShift(struct Decimal *A, int K) {
+    // Product digits go into Tmp from the right; the shift adds at most 19.
+    unsigned char Tmp[MAX_DECIMAL_DIGITS + 20];
+    int W = sizeof(Tmp);
+    uint64_t N = 0;
+    for (int R = A->NumDigits - 1; R >= 0; R--) {
+        N += (uint64_t) A->D[R] << K;
+        Tmp[--W] = N % 10;
+        N /= 10;
+    }
+    while (N > 0) {
+        Tmp[--W] = N % 10;
+        N /= 10;
+    }
+    
+    int NumDigits = (int) sizeof(Tmp) - W;
+    A->DecimalPoint += NumDigits - A->NumDigits;
+    if (NumDigits > MAX_DECIMAL_DIGITS) {
+        for (int i = W + MAX_DECIMAL_DIGITS; i < (int) sizeof(Tmp); i++) {
+            A->Truncated |= Tmp[i] != 0;
+        }
+        NumDigits = MAX_DECIMAL_DIGITS;
+    }
+    memcpy(A->D, Tmp + W, NumDigits);
+    A->NumDigits = NumDigits;
+    DecimalTrim(A);
+}
+
+/// DecimalShift - Multiply A by 2^K, or divide it by 2^-K if K < 0.
+static void DecimalShift(struct Decimal *A, int K) {
+    if (A->NumDigits == 0) {
+        return;
+    }
+    for (; K > MAX_DECIMAL_SHIFT; K -= MAX_DECIMAL_SHIFT) {
+        DecimalLeftShift(A, MAX_DECIMAL_SHIFT);
+    }
+    for (; K < -MAX_DECIMAL_SHIFT; K += MAX_DECIMAL_SHIFT) {
+        DecimalRightShift(A, MAX_DECIMAL_SHIFT);
+    }
+    if (K > 0) {
+        DecimalLeftShift(A, K);
+    } else if (K < 0) {
+        DecimalRightShift(A, -K);
+    }
+}
+
+/// DecimalRoundedInteger - A rounded to the nearest integer, ties to even,
+/// for an A below 2^64.
+static uint64_t DecimalRoundedInteger(const struct Decimal *A) {
+    uint64_t N = 0;
+    int i = 0;
+    for (; i < A->DecimalPoint && i < A->NumDigits; i++) {
+        N = N * 10 + A->D[i];
+    }
+    for (; i < A->DecimalPoint; i++) {
+        N *= 10;
+    }
+    
+    int Next = A->DecimalPoint; // The first digit after the point.
+    if (Next >= 0 && Next < A->NumDigits) {
+        if (A->D[Next] == 5 && Next + 1 == A->NumDigits && !A->Truncated) {
+            N += N & 1; // Exactly halfway.
+        } else {
+            N += A->D[Next] >= 5;
+        }
+    }
+    return N;
+}
+
+/// DecimalToDouble - The double nearest to the literal from P to End.  A
+/// Decimal holding it is scaled by powers of 2 into [1, 2), or to the
+/// smallest exponent for subnormals, and then by 2^52, leaving the mantissa
+/// to round off as an integer.
+static double DecimalToDouble(const char *P, const char *End) {
+    struct Decimal A;
+    A.NumDigits = 0;
+    A.Truncated = 0;
+    int NumRead = 0, SeenPoint = 0;
+    A.DecimalPoint = 0;
+    for (; P != End; P++) {
+        if (*P == '.') {
+            if (SeenPoint) {
+                break;
+            }
+            SeenPoint = 1;
+            A.DecimalPoint = NumRead;
+        } else if (*P == '0' && NumRead == 0) {
+            A.DecimalPoint -= SeenPoint; // Leading zeros.
+        } else {
+            if (A.NumDigits < MAX_DECIMAL_DIGITS) {
+                A.D[A.NumDigits++] = *P - '0';
+            } else if (*P != '0') {
+                A.Truncated = 1;
+            }
+            NumRead++;
+        }
+    }
+    if (!SeenPoint) {
+        A.DecimalPoint = NumRead;
+    }
+    DecimalTrim(&A);
+    
+    if (A.NumDigits == 0 || A.DecimalPoint < -330) {
+        return 0.0;
+    } else if (A.DecimalPoint > 310) {
+        return HUGE_VAL;
+    }
+    
+    // Each step shifts by as many bits as are sure to keep its digits.
+    static const int PowTab[] = { 1, 3, 6, 9, 13, 16, 19, 23, 26 };
+    const int NumPowTab = (int) (sizeof(PowTab) / sizeof(PowTab[0]));
+    int Exp = 0;
+    while (A.DecimalPoint > 0) {
+        int N = A.DecimalPoint >= NumPowTab ? 27 : PowTab[A.DecimalPoint];
+        DecimalShift(&A, -N);
+        Exp += N;
+    }
+    while (A.DecimalPoint < 0 || (A.DecimalPoint == 0 && A.D[0] < 5)) {
+        int N = -A.DecimalPoint >= NumPowTab ? 27 : PowTab[-A.DecimalPoint];
+        DecimalShift(&A, N);
+        Exp -= N;
+    }
+    
+    // A is in [0.5, 1); doubles have their mantissa in [1, 2).
+    Exp--;
+    if (Exp < -1022) {
+        DecimalShift(&A, Exp + 1022); // Subnormal.
+        Exp = -1022;
+    }
+    if (Exp > 1023) {
+        return HUGE_VAL;
+    }
+    DecimalShift(&A, 53);
+    uint64_t Mant = DecimalRoundedInteger(&A);
+    if (Mant == (uint64_t) 1 << 53) {
+        // Rounding carried into a new bit.
+        Mant >>= 1;
+        if (++Exp > 1023) {
+            return HUGE_VAL;
+        }
+    }
+    return ldexp((double) Mant, Exp - 52);
+}
+
+/// RoundQuotient - M / (5^K * 2^K) rounded to the nearest double, for K up
+/// to 27, where 5^K fits in 63 bits.  The quotient is worked out to 63 or 64
+/// bits and then rounded to 53, ties to even, with the remainder as the
+/// sticky bit.
+static double RoundQuotient(uint64_t M, int K) {
+    uint64_t D = 1;
+    for (int i = 0; i < K; i++) {
+        D *= 5;
+    }
+    int Shift = 63 + (64 - __builtin_clzll(D)) - (64 - __builtin_clzll(M));
+    unsigned __int128 N = (unsigned __int128) M << Shift;
+    uint64_t Q = (uint64_t) (N / D);
+    int Sticky = N % D != 0;
+    
+    int Drop = (64 - __builtin_clzll(Q)) - 53;
+    uint64_t Mant = Q >> Drop;
+    uint64_t Rest = Q & (((uint64_t) 1 << Drop) - 1);
+    uint64_t Half = (uint64_t) 1 << (Drop - 1);
+    if (Rest > Half || (Rest == Half && (Sticky || (Mant & 1)))) {
+        if (++Mant == (uint64_t) 1 << 53) {
+            Mant >>= 1;
+            Drop++;
+        }
+    }
+    return ldexp((double) Mant, Drop - Shift - K);
+}
+
+/// ScanNumber - The value of the literal from P to End, correctly rounded.
+static double ScanNumber(const char *P, const char *End) {
+    static const double Pow10[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    const char *Start = P;
+    uint64_t M = 0;
+    int NumDigits = 0, K = 0, SeenPoint = 0;
+    for (; P != End; P++) {
+        if (*P == '.') {
+            if (SeenPoint) {
+                break;
+            }
+            SeenPoint = 1;
+            continue;
+        }
+        if (NumDigits == 19) {
+            return DecimalToDouble(Start, End);
+        }
+        M = M * 10 + (*P - '0');
+        NumDigits += M != 0;
+        K += SeenPoint;
+    }
+    
+    if (K == 0 || M == 0) {
+        return (double) M;
+    } else if (M <= (uint64_t) 1 << 53 && K <= 22) {
+        // Both are exact doubles, so the division rounds correctly.
+        return (double) M / Pow10[K];
+    } else if (K <= 27) {
+        return RoundQuotient(M, K);
+    }
+    return DecimalToDouble(Start, End);
+}
+
+/// gettok - Return the next token from the source buffer.
+static int gettok() {
+    const char *P = Ctx->CurPtr;
+    const char *Start;
+    
+    // Skip any whitespace.
+    do {
+        while (isspace((unsigned char) *P)) {
+            P++;
+        }
+        Start = P;
+    } while (P == Ctx->BufferEnd && FillSource(&Start, &P));
+    
+    if (isalpha((unsigned char) *P)) { // identifier: [a-zA-Z][a-zA-Z0-9]*
+        do {
+            while (isalnum((unsigned char) *P)) {
+                P++;
+            }
+        } while (P == Ctx->BufferEnd && FillSource(&Start, &P));
+        Ctx->CurPtr = P;
+        
+        int Sym = InternSymbol(Start, P - Start);
+        if (Sym < NUM_KEYWORDS) {
+            return KeywordTokens[Sym];
+        }
+        
+        Ctx->IdentifierSym = Sym;
+        return tok_identifier;
+    }
+    
+    if (isdigit((unsigned char) *P) || *P == '.') { // Number: [0-9.]+
+        do {
+            while (isdigit((unsigned char) *P) || *P == '.') {
+                P++;
+            }
+        } while (P == Ctx->BufferEnd && FillSource(&Start, &P));
+        Ctx->CurPtr = P;
+        Ctx->NumVal = ScanNumber(Start, P);
+        return tok_number;
+    }
+
+    if (*P == '#') {
+        // Comment until end of line.
+        do {
+            while (P != Ctx->BufferEnd && *P != '\n' && *P != '\r') {
+                P++;
+            }
+            Start = P;
+        } while (P == Ctx->BufferEnd && FillSource(&Start, &P));
+        Ctx->CurPtr = P;
+        
+        if (P != Ctx->BufferEnd)
+            return gettok();
+    }
+    
+    // Check for end of file.  Don't eat the EOF.
+    if (P == Ctx->BufferEnd) {
+        Ctx->CurPtr = P;
+        return tok_eof;
+    }
+    
+    // Otherwise, just return the character as its ascii value.
+    Ctx->CurPtr = P + 1;
+    return (unsigned char) *P;
+}
+
+#pragma mark Abstract Syntax Tree (aka Parse Tree)
+
+/// ExprKind - Identifies which expression struct an ExprAST pointer refers to.
+enum ExprKind {
+    expr_number,
+    expr_variable,
+    expr_binary,
+    expr_call,
+    expr_if,
+    expr_for,
+    expr_cast
+};
+
+/// ExprAST - Common header for all expression nodes.  It is the first member
+/// of every expression struct, so any node can be viewed as an ExprAST and
+/// dispatched on its Kind with a single switch.  Type is the ValueType of
+/// the node's value; it is f64 until ResolveFunction has typed the tree.
+struct ExprAST {
+    enum ExprKind Kind;
+    unsigned char Type;
+};
+
+/// NumberExprAST - Expression class for numeric literals like "1.0".  Val is
+/// already rounded to float for an f32 literal, and integral for an i64 one.
+struct NumberExprAST {
+    struct ExprAST Base;
+    double Val;
+};
+
+/// VariableExprAST - Expression class for referencing a variable, like "a".
+struct VariableExprAST {
+    struct ExprAST Base;
+    int Name;
+    int Slot; // Frame slot, filled in by ResolveFunction.
+};
+
+/// BinaryExprAST - Expression class for a binary operator.
+struct BinaryExprAST {
+    struct ExprAST Base;
+    char Op;
+    struct ExprAST *LHS, *RHS;
+};
+
+/// CallExprAST - Expression class for function calls.  The arguments are
+/// allocated along with the node, with ALLOC_EXPR_ARGS.
+struct CallExprAST {
+    struct ExprAST Base;
+    int Callee;
+    int Sig; // The callee's Sig that ResolveFunction typed the call against.
+    int NumArgs;
+    struct ExprAST *Args[];
+};
+
+/// IfExprAST - Expression class for if/then/else.
+struct IfExprAST {
+    struct ExprAST Base;
+    struct ExprAST *Cond, *Then, *Else;
+};
+
+/// ForExprAST - Expression class for for/in.  Step is NULL if omitted.
+/// VarType is the loop variable's declared type, or -1 until ResolveFunction
+/// gives it the type of Start.
+struct ForExprAST {
+    struct ExprAST Base;
+    int VarName;
+    int Slot; // Frame slot of the loop variable, filled in by ResolveFunction.
+    int VarType;
+    struct ExprAST *Start, *End, *Step, *Body;
+};
+
+/// CastExprAST - Conversion of Operand to Base.Type, which ResolveFunction
+/// inserts wherever a value is used as another type.
+struct CastExprAST {
+    struct ExprAST Base;
+    struct ExprAST *Operand;
+};
+
+/// PrototypeAST - This class represents the "prototype" for a function,
+/// which captures its name, and its argument names (thus implicitly the number
+/// of arguments the function takes).  Allocated with ALLOC_STRUCT_ARGS.
+/// ArgTypes is NULL when every argument is f64.  Sig is 0 when the arguments
+/// and result all are, and otherwise a symbol spelling out the signature,
+/// such as "(f32,i64)f64", so that calls can check it with one compare.
+struct PrototypeAST {
+    int Name;
+    int Sig;
+    unsigned char RetType;
+    unsigned char *ArgTypes;
+    int NumArgs;
+    int Args[];
+};
+
+static int ArgType(const struct PrototypeAST *P, int i) {
+    return P->ArgTypes ? P->ArgTypes[i] : type_f64;
+}
+
+/// FunctionAST - This class represents a function definition itself.
+/// NumSlots is the size of its frame, the arguments followed by a slot for
+/// each level of loop nesting, and is filled in by ResolveFunction.
+struct FunctionAST {
+    struct PrototypeAST *Proto;
+    struct ExprAST *Body;
+    int NumSlots;
+};
+
+#pragma mark Statistics
+
+/// With --stats, the time spent in each phase and what the parser allocated
+/// are collected as the input is handled.  Phases are entered and left with
+/// EnterPhase, which charges the time since the last change to the phase
+/// being left, so each phase's time excludes the phases nested inside it:
+/// parsing does not include the lexing it asks for.
+
+/// Phase - What the compiler is busy with.
+enum Phase {
+    phase_other,
+    phase_lex,
+    phase_parse,
+    phase_codegen,
+    phase_optimize,
+    phase_jit, // Compiling to machine code, for the JIT or an object file.
+    phase_execute,
+    NUM_PHASES
+};
+
+static const char *const PhaseNames[NUM_PHASES] = {
+    "other", "lex", "parse", "codegen", "optimize", "jit", "execute"
+};
+
+static const char *const ExprKindNames[] = {
+    "number", "variable", "binary", "call", "if", "for", "cast"
+};
+
+#define NUM_EXPR_KINDS ((int) (sizeof(ExprKindNames) / sizeof(ExprKindNames[0])))
+
+struct Stats {
+    enum Phase CurPhase;
+    double PhaseStart;
+    double PhaseTime[NUM_PHASES];
+    long NodeCounts[NUM_EXPR_KINDS];
+    long NumAllocs;        // Arena allocations made while parsing.
+    size_t BytesAllocated; // By them, padding included.
+};
+
+/// IsCompileWorker - Set on batch compile worker threads and the tier-up
+/// thread.  Their time is not charged to any phase; the main thread waiting
+/// for them is.
+static __thread int IsCompileWorker;
+
+/// IsTierWorker - Set on the tier-up thread, whose compiles are speculative:
+/// a function it cannot compile stays in the VM, which reports the errors.
+static __thread int IsTierWorker;
+
+static double StatsClock() {
+    struct timespec Ts;
+    clock_gettime(CLOCK_MONOTONIC, &Ts);
+    return Ts.tv_sec + Ts.tv_nsec * 1e-9;
+}
+
+/// EnterPhase - Switch to phase P, returning the phase to switch back to.
+static enum Phase EnterPhase(enum Phase P) {
+    struct Stats *S = Ctx->Stats;
+    if (!S || IsCompileWorker) {
+        return phase_other;
+    }
+    double Now = StatsClock();
+    S->PhaseTime[S->CurPhase] += Now - S->PhaseStart;
+    S->PhaseStart = Now;
+    enum Phase Prev = S->CurPhase;
+    S->CurPhase = P;
+    return Prev;
+}
+
+/// CountAlloc - Count an arena allocation of Size bytes, if the parser
+/// made it.
+static void CountAlloc(size_t Size) {
+    struct Stats *S = Ctx->Stats;
+    if (S->CurPhase == phase_parse) {
+        S->NumAllocs++;
+        S->BytesAllocated += Size;
+    }
+}
+
+/// CountNode - Count an AST node of the given kind, if the parser made it.
+static void CountNode(enum ExprKind Kind) {
+    struct Stats *S = Ctx->Stats;
+    if (S->CurPhase == phase_parse) {
+        S->NodeCounts[Kind]++;
+    }
+}
+
+/// PrintStats - Report the statistics collected so far on stderr.
+static void PrintStats() {
+    struct Stats *S = Ctx->Stats;
+    EnterPhase(S->CurPhase); // Bring the current phase up to date.
+    
+    double Total = 0;
+    for (int i = 0; i < NUM_PHASES; i++) {
+        Total += S->PhaseTime[i];
+    }
+    fprintf(stderr, "Time:\n");
+    for (int i = 1; i <= NUM_PHASES; i++) {
+        int P = i % NUM_PHASES; // other goes last
+        fprintf(stderr, "  %-10s %10.3f ms %5.1f%%\n", PhaseNames[P],
+                S->PhaseTime[P] * 1e3,
+                Total > 0 ? 100 * S->PhaseTime[P] / Total : 0.0);
+    }
+    fprintf(stderr, "  %-10s %10.3f ms\n", "total", Total * 1e3);
+    
+    long NumNodes = 0;
+    fprintf(stderr, "AST nodes:\n");
+    for (int i = 0; i < NUM_EXPR_KINDS; i++) {
+        fprintf(stderr, "  %-10s %10ld\n", ExprKindNames[i], S->NodeCounts[i]);
+        NumNodes += S->NodeCounts[i];
+    }
+    fprintf(stderr, "  %-10s %10ld\n", "total", NumNodes);
+    fprintf(stderr, "Parser allocated %zu bytes in %ld allocations\n",
+            S->BytesAllocated, S->NumAllocs);
+}
+
+#pragma mark Parser
+
+/// CurTok/getNextToken - Provide a simple token buffer.  Ctx->CurTok is the
+/// current token the parser is looking at.  getNextToken reads another token
+/// from the lexer and updates CurTok with its results.
+static int getNextToken() {
+    if (!Ctx->Stats) {
+        return Ctx->CurTok = gettok();
+    }
+    enum Phase Prev = EnterPhase(phase_lex);
+    Ctx->CurTok = gettok();
+    EnterPhase(Prev);
+    return Ctx->CurTok;
+}
+
+/// GetTokPrecedence - Get the precedence of the pending binary operator token.
+static int GetTokPrecedence() {
+    // Keywords and other non-character tokens are negative.
+    if ((unsigned) Ctx->CurTok > 255) {
+        return -1;
+    }
+    
+    // Make sure it's a declared binop.
+    int TokPrec = Ctx->BinopPrecedence[Ctx->CurTok];
+    if (TokPrec <= 0)
+        return -1;
+    return TokPrec;
+}
+
+/// LogError - Append the message Error would print to ErrorLog.
+static void LogError(const char *Str) {
+    size_t Len = strlen(Str) + sizeof("Error: \n") - 1;
+    if (Ctx->ErrorLogLen + Len + 1 > Ctx->ErrorLogCapacity) {
+        Ctx->ErrorLogCapacity = 2 * (Ctx->ErrorLogLen + Len + 1);
+        Ctx->ErrorLog = (char *) realloc(Ctx->ErrorLog, Ctx->ErrorLogCapacity);
+    }
+    sprintf(Ctx->ErrorLog + Ctx->ErrorLogLen, "Error: %s\n", Str);
+    Ctx->ErrorLogLen += Len;
+}
+
+/// Error* - These are little helper functions for error handling.  Compile
+/// workers report errors too, hence the atomic count.
+static void* Error(const char *Str) {
+    if (IsTierWorker) {
+        return NULL;
+    }
+    if (Ctx->LogErrors) {
+        LogError(Str);
+    } else {
+        fprintf(stderr, "Error: %s\n", Str);
+    }
+    __atomic_add_fetch(&Ctx->NumErrors, 1, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+static struct PrototypeAST* ErrorP(const char *Str) {
+    Error(Str);
+    return NULL;
+}
+
+static struct ExprAST* ParseExpression();
+
+/// typeannotation ::= ':' type
+/// ParseType - Parse an annotation, returning the ValueType or -1 on error.
+static int ParseType() {
+    getNextToken(); // eat ':'.
+    int Type = Ctx->IdentifierSym - NUM_KEYWORDS;
+    if (Ctx->CurTok != tok_identifier || Type < 0 || Type >= NUM_TYPES) {
+        Error("expected f64, f32 or i64 after ':'");
+        return -1;
+    }
+    getNextToken(); // eat the type.
+    return Type;
+}
+
+/// numberexpr ::= number
+static struct ExprAST* ParseNumberExpr() {
+    ALLOC_EXPR(Result, NumberExprAST, expr_number);
+    Result->Val = Ctx->NumVal;
+    
+    getNextToken(); // consume the number
+    return &Result->Base;
+}
+
+/// parenexpr ::= '(' expression ')'
+static struct ExprAST* ParseParenExpr() {
+    getNextToken(); // eat (.
+    struct ExprAST *V = ParseExpression();
+    if (!V) {
+        return NULL;
+    }
+    
+    if (Ctx->CurTok != ')') {
+        return Error("expected ')'");
+    }
+    
+    getNextToken(); // eat ).
+    return V;
+}
+
+/// PushArg - Push a parsed call argument onto ArgStack.
+static void PushArg(struct ExprAST *Arg) {
+    if (Ctx->NumArgStack == Ctx->ArgStackCapacity) {
+        Ctx->ArgStackCapacity =
+            Ctx->ArgStackCapacity ? Ctx->ArgStackCapacity * 2 : 256;
+        Ctx->ArgStack = (struct ExprAST **) realloc(
+            Ctx->ArgStack, Ctx->ArgStackCapacity * sizeof(struct ExprAST *));
+    }
+    Ctx->ArgStack[Ctx->NumArgStack++] = Arg;
+}
+
+/// identifierexpr
+///   ::= identifier
+///   ::= identifier '(' expression* ')'
+static struct ExprAST* ParseIdentifierExpr() {
+    int IdName = Ctx->IdentifierSym;
+    
+    getNextToken(); // eat identifier.
+    
+    if (Ctx->CurTok != '(') { // Simple variable ref.
+        ALLOC_EXPR(Result, VariableExprAST, expr_variable);
+        Result->Name = IdName;
+        
+        return &Result->Base;
+    }
+    
+    // Call.
+    getNextToken(); // eat (
+    
+    int Base = Ctx->NumArgStack;
+    if (Ctx->CurTok != ')') {
+        while (1) {
+            struct ExprAST *Arg = ParseExpression();
+            if (Arg != NULL) {
+                PushArg(Arg);
+            } else {
+                Ctx->NumArgStack = Base;
+                return NULL;
+            }
+            
+            if (Ctx->CurTok == ')') {
+                break;
+            }
+            
+            if (Ctx->CurTok != ',') {
+                Ctx->NumArgStack = Base;
+                return Error("Expected ')' or ',' in argument list");
+            }
+            getNextToken();
+        }
+    }
+    
+    // Eat the ')'.
+    getNextToken();
+    
+    ALLOC_EXPR_ARGS(Result, CallExprAST, expr_call, Ctx->NumArgStack - Base);
+    Result->Callee = IdName;
+    memcpy(Result->Args, Ctx->ArgStack + Base,
+           Result->NumArgs * sizeof(struct ExprAST *));
+    Ctx->NumArgStack = Base;
+    
+    return &Result->Base;
+    //make_unique<CallExprAST>(IdName, std::move(Args));
+}
+
+/// ifexpr ::= 'if' expression 'then' expression 'else' expression
+static struct ExprAST* ParseIfExpr() {
+    getNextToken(); // eat the if.
+    
+    // condition.
+    struct ExprAST *Cond = ParseExpression();
+    if (!Cond) {
+        return NULL;
+    }
+    
+    if (Ctx->CurTok != tok_then) {
+        return Error("expected then");
+    }
+    getNextToken(); // eat the then
+    
+    struct ExprAST *Then = ParseExpression();
+    if (!Then) {
+        return NULL;
+    }
+    
+    if (Ctx->CurTok != tok_else) {
+        return Error("expected else");
+    }
+    getNextToken();
+    
+    struct ExprAST *Else = ParseExpression();
+    if (!Else) {
+        return NULL;
+    }
+    
+    ALLOC_EXPR(Result, IfExprAST, expr_if);
+    Result->Cond = Cond;
+    Result->Then = Then;
+    Result->Else = Else;
+    return &Result->Base;
+}
+
+/// forexpr
+///   ::= 'for' identifier typeannotation? '=' expr ',' expr (',' expr)?
+///       'in' expression
+static struct ExprAST* ParseForExpr() {
+    getNextToken(); // eat the for.
+    
+    if (Ctx->CurTok != tok_identifier) {
+        return Error("expected identifier after for");
+    }
+    
+    int IdName = Ctx->IdentifierSym;
+    getNextToken(); // eat identifier.
+    
+    int VarType = -1;
+    if (Ctx->CurTok == ':' && (VarType = ParseType()) < 0) {
+        return NULL;
+    }
+    
+    if (Ctx->CurTok != '=') {
+        return Error("expected '=' after for");
+    }
+    getNextToken(); // eat '='.
+    
+    struct ExprAST *Start = ParseExpression();
+    if (!Start) {
+        return NULL;
+    }
+    if (Ctx->CurTok != ',') {
+        return Error("expected ',' after for start value");
+    }
+    getNextToken();
+    
+    struct ExprAST *End = ParseExpression();
+    if (!End) {
+        return NULL;
+    }
+    
+    // The step value is optional.
+    struct ExprAST *Step = NULL;
+    if (Ctx->CurTok == ',') {
+        getNextToken();
+        Step = ParseExpression();
+        if (!Step) {
+            return NULL;
+        }
+    }
+    
+    if (Ctx->CurTok != tok_in) {
+        return Error("expected 'in' after for");
+    }
+    getNextToken(); // eat 'in'.
+    
+    struct ExprAST *Body = ParseExpression();
+    if (!Body) {
+        return NULL;
+    }
+    
+    ALLOC_EXPR(Result, ForExprAST, expr_for);
+    Result->VarName = IdName;
+    Result->VarType = VarType;
+    Result->Start = Start;
+    Result->End = End;
+    Result->Step = Step;
+    Result->Body = Body;
+    return &Result->Base;
+}
+
+/// primary
+///   ::= identifierexpr
+///   ::= numberexpr
+///   ::= parenexpr
+///   ::= ifexpr
+///   ::= forexpr
+static struct ExprAST* ParsePrimary() {
+    switch (Ctx->CurTok) {
+        default:
+            return Error("unknown token when expecting an expression");
+        case tok_identifier:
+            return ParseIdentifierExpr();
+        case tok_number:
+            return ParseNumberExpr();
+        case '(':
+            return ParseParenExpr();
+        case tok_if:
+            return ParseIfExpr();
+        case tok_for:
+            return ParseForExpr();
+    }
+}
+
+static int IsNumber(const struct ExprAST *E, double Val) {
+    return E->Kind == expr_number &&
+           ((const struct NumberExprAST *) E)->Val == Val;
+}
+
+/// BuildBinaryExpr - Make the node for LHS Op RHS, folding it as the tree is
+/// built.  Operations on two f64 literals are evaluated, reusing the LHS node
+/// for the result, and identities that hold for every value, including -0.0,
+/// infinities and NaN (x*1, 1*x, x-(+0)), return the other operand unchanged.
+/// The node made is f64; typed callers set its type.
+static struct ExprAST* BuildBinaryExpr(int Op, struct ExprAST *LHS,
+                                       struct ExprAST *RHS) {
+    if (LHS->Kind == expr_number && RHS->Kind == expr_number &&
+        LHS->Type == type_f64 && RHS->Type == type_f64) {
+        struct NumberExprAST *L = (struct NumberExprAST *) LHS;
+        double R = ((struct NumberExprAST *) RHS)->Val;
+        switch (Op) {
+            case '+': L->Val = L->Val + R; return LHS;
+            case '-': L->Val = L->Val - R; return LHS;
+            case '*': L->Val = L->Val * R; return LHS;
+            case '<': L->Val = L->Val < R ? 1.0 : 0.0; return LHS;
+        }
+    }
+    
+    if (Op == '*' && IsNumber(RHS, 1.0)) {
+        return LHS;
+    }
+    if (Op == '-' && IsNumber(RHS, 0.0) &&
+        !signbit(((struct NumberExprAST *) RHS)->Val)) {
+        return LHS;
+    }
+    if (Op == '*' && IsNumber(LHS, 1.0)) {
+        return RHS;
+    }
+    
+    ALLOC_EXPR(Result, BinaryExprAST, expr_binary);
+    Result->LHS = LHS;
+    Result->RHS = RHS;
+    Result->Op = Op;
+    return &Result->Base;
+}
+
+/// binoprhs
+///   ::= ('+' primary)*
+static struct ExprAST* ParseBinOpRHS(int ExprPrec, struct ExprAST *LHS) {
+    // If this is a binop, find its precedence.
+    while (1) {
+        int TokPrec = GetTokPrecedence();
+        
+        // If this is a binop that binds at least as tightly as the current binop,
+        // consume it, otherwise we are done.
+        if (TokPrec < ExprPrec)
+            return LHS;
+        
+        // Okay, we know this is a binop.
+        int BinOp = Ctx->CurTok;
+        getNextToken(); // eat binop
+        
+        // Parse the primary expression after the binary operator.
+        struct ExprAST *RHS = ParsePrimary();
+        if (!RHS) {
+            return NULL;
+        }
+        
+        // If BinOp binds less tightly with RHS than the operator after RHS, let
+        // the pending operator take RHS as its LHS.
+        int NextPrec = GetTokPrecedence();
+        if (TokPrec < NextPrec) {
+            RHS = ParseBinOpRHS(TokPrec + 1, RHS);
+            if (!RHS)
+                return NULL;
+        }
+        
+        // Merge LHS/RHS.
+        LHS = BuildBinaryExpr(BinOp, LHS, RHS);
+        
+        //make_unique<BinaryExprAST>(BinOp, std::move(LHS), std::move(RHS));
+    }
+}
+
+/// expression
+///   ::= primary binoprhs
+///
+static struct ExprAST* ParseExpression() {
+    struct ExprAST *LHS = ParsePrimary();
+    if (!LHS) {
+        return NULL;
+    }
+    
+    return ParseBinOpRHS(0, LHS);
+}
+
+/// SetSignature - Fill in P's Sig from its types.
+static void SetSignature(struct PrototypeAST *P) {
+    P->Sig = 0;
+    if (!P->ArgTypes && P->RetType == type_f64) {
+        return;
+    }
+    char Sig[4 * P->NumArgs + 8];
+    char *S = Sig;
+    *S++ = '(';
+    for (int i = 0; i < P->NumArgs; i++) {
+        S += sprintf(S, i ? ",%s" : "%s", TypeNames[ArgType(P, i)]);
+    }
+    S += sprintf(S, ")%s", TypeNames[P->RetType]);
+    P->Sig = InternSymbol(Sig, S - Sig);
+}
+
+/// prototype
+///   ::= id '(' (id typeannotation?)* ')' typeannotation?
+static struct PrototypeAST* ParsePrototype() {
+    if (Ctx->CurTok != tok_identifier) {
+        return ErrorP("Expected function name in prototype");
+    }
+    
+    int FnName = Ctx->IdentifierSym;
+    
+    getNextToken();
+    
+    if (Ctx->CurTok != '(') {
+        return ErrorP("Expected '(' in prototype");
+    }
+    
+    
+    int NumArgs = 0, Typed = 0;
+    
+    //std::vector<std::string> ArgNames;
+    getNextToken(); // eat '('.
+    while (Ctx->CurTok == tok_identifier) {
+        //ArgNames.push_back(IdentifierStr);
+        if (NumArgs == Ctx->ParamBufCapacity) {
+            Ctx->ParamBufCapacity =
+                Ctx->ParamBufCapacity ? Ctx->ParamBufCapacity * 2 : 64;
+            Ctx->ParamBuf = (int *)
+                realloc(Ctx->ParamBuf, Ctx->ParamBufCapacity * sizeof(int));
+            Ctx->ParamTypeBuf = (unsigned char *)
+                realloc(Ctx->ParamTypeBuf, Ctx->ParamBufCapacity);
+        }
+        Ctx->ParamBuf[NumArgs] = Ctx->IdentifierSym;
+        int Type = type_f64;
+        if (getNextToken() == ':' && (Type = ParseType()) < 0) {
+            return NULL;
+        }
+        Ctx->ParamTypeBuf[NumArgs++] = (unsigned char) Type;
+        Typed |= Type != type_f64;
+    }
+    
+    if (Ctx->CurTok != ')') {
+        return ErrorP("Expected ')' in prototype");
+    }
+    
+    // success.
+    getNextToken(); // eat ')'.
+    int RetType = type_f64;
+    if (Ctx->CurTok == ':' && (RetType = ParseType()) < 0) {
+        return NULL;
+    }
+    
+    ALLOC_STRUCT_ARGS(Result, PrototypeAST, NumArgs);
+    Result->Name = FnName;
+    Result->RetType = (unsigned char) RetType;
+    Result->ArgTypes = NULL;
+    if (Typed) {
+        Result->ArgTypes = (unsigned char *) ArenaAlloc(Ctx->CurArena, NumArgs);
+        memcpy(Result->ArgTypes, Ctx->ParamTypeBuf, NumArgs);
+    }
+    memcpy(Result->Args, Ctx->ParamBuf, NumArgs * sizeof(int));
+    SetSignature(Result);
+    return Result;
+    //make_unique<PrototypeAST>(FnName, std::move(ArgNames));
+}
+
+/// definition ::= 'def' prototype expression
+static struct FunctionAST* ParseDefinition() {
+    getNextToken(); // eat def.
+    struct PrototypeAST *Proto = ParsePrototype();
+    if (!Proto) {
+        return NULL;
+    }
+    
+    struct ExprAST *E = ParseExpression();
+    if (E != NULL) {
+        ALLOC_STRUCT(Result, FunctionAST);
+        Result->Proto = Proto;
+        Result->Body = E;
+        
+        return Result;
+    }
+    
+    return NULL;
+}
+
+/// toplevelexpr ::= expression
+static struct FunctionAST* ParseTopLevelExpr() {
+    struct ExprAST *E = ParseExpression();
+    if (E != NULL) {
+        // Make an anonymous proto.
+        ALLOC_STRUCT_ARGS(Proto, PrototypeAST, 0);
+        Proto->Name = Ctx->AnonExprSym;
+        Proto->Sig = 0;
+        Proto->RetType = type_f64;
+        Proto->ArgTypes = NULL;
+        
+        ALLOC_STRUCT(Result, FunctionAST);
+        Result->Proto = Proto;
+        Result->Body = E;
+        
+        return Result;
+        
+    }
+    return NULL;
+}
+
+/// external ::= 'extern' prototype
+static struct PrototypeAST* ParseExtern() {
+    getNextToken(); // eat extern.
+    return ParsePrototype();
+}
+
+#pragma mark Evaluator
+
+/// NativeFunction - A C function that an 'extern' can bind to.  All of them
+/// take and return doubles; NumArgs says which signature Fn really has.  A
+/// Pure one has no effect but its result; see IsPureFunction.
+struct NativeFunction {
+    const char *Name;
+    int NumArgs;
+    int Pure;
+    double (*Fn)();
+};
+
+/// putchard - putchar that takes a double and returns 0.
+static double putchard(double X) {
+    fputc((char) X, stderr);
+    return 0;
+}
+
+/// printd - printf that takes a double prints it as "%f\n", returning 0.
+static double printd(double X) {
+    fprintf(stderr, "%f\n", X);
+    return 0;
+}
+
+static const struct NativeFunction NativeFunctions[] = {
+    { "putchard", 1, 0, (double (*)()) putchard },
+    { "printd", 1, 0, (double (*)()) printd },
+    { "sin", 1, 1, (double (*)()) sin },
+    { "cos", 1, 1, (double (*)()) cos },
+    { "tan", 1, 1, (double (*)()) tan },
+    { "atan", 1, 1, (double (*)()) atan },
+    { "atan2", 2, 1, (double (*)()) atan2 },
+    { "sqrt", 1, 1, (double (*)()) sqrt },
+    { "exp", 1, 1, (double (*)()) exp },
+    { "log", 1, 1, (double (*)()) log },
+    { "pow", 2, 1, (double (*)()) pow },
+    { "fabs", 1, 1, (double (*)()) fabs },
+    { "floor", 1, 1, (double (*)()) floor },
+    { "ceil", 1, 1, (double (*)()) ceil },
+    { "fmod", 2, 1, (double (*)()) fmod },
+};
+
+#define NUM_NATIVE_FUNCTIONS \
+    ((int) (sizeof(NativeFunctions) / sizeof(NativeFunctions[0])))
+
+/// TierCode - Native code the tier-up thread compiled for a function, valid
+/// while no function has changed since Generation.  Fn takes the arguments
+/// as VM registers and returns the result as one.
+struct TierCode {
+    double (*Fn)(const double *Args);
+    int Generation;
+    LLVMOrcResourceTrackerRef Tracker;
+    struct TierCode *NextRetired;
+};
+
+/// FunctionEntry - What is known about the function with a given name.  Proto
+/// is set once it has been defined or declared extern; exactly one of Def
+/// (a Kaleidoscope body) and Native (for externs) is then set.
+struct FunctionEntry {
+    struct PrototypeAST *Proto;
+    struct FunctionAST *Def;
+    const struct NativeFunction *Native;
+    struct Bytecode *Code; // Def compiled for the VM back end, if any.
+    struct FlatExpr *Flat; // Def flattened for --flat-ast, if any.
+    int InJIT;             // Proto's symbol has been defined in the JIT.
+    
+    // Def is Source, the definition as written, with small callees inlined;
+    // see InlineFunction.  InlineDeps are the defs that went into it, and
+    // DefStamp is the DefGeneration it was last replaced at.  RefreshInlined
+    // rebuilds Def, Code and Flat into InlineArena.  Inline describes Def to
+    // the defs that inline it.
+    struct FunctionAST *Source;
+    struct InlineInfo *Inline;
+    struct InlineDep *InlineDeps;
+    int NumInlineDeps;
+    int DefStamp;
+    struct Arena InlineArena;
+    int RefreshPass;       // The last RefreshInlined pass that visited it.
+    
+    struct Arena Arena;    // Holds Source, and Def and Code as first built.
+    int Version;           // Bumped each time Def is replaced.
+    uint64_t Hash;         // HashFunction(Def), under the JIT.
+    
+    // Outside batch mode, JIT'd callers of Def call through Address, so Def
+    // can be recompiled on its own; Tracker owns the code it points at.
+    void *Address;
+    LLVMOrcResourceTrackerRef Tracker;
+    
+    // silly_eval_batch's JIT'd loop over the function, owned by KernelTracker.
+    // It inlines everything it calls, so it is stale once any function has
+    // changed since KernelGeneration.
+    void (*Kernel)(const double **, double *, size_t);
+    int KernelGeneration;
+    LLVMOrcResourceTrackerRef KernelTracker;
+    
+    // Under the VM with --tier-threshold, the calls made to Code since
+    // CallsGeneration, and the native code it was tiered up to.
+    int Calls;
+    int CallsGeneration;
+    struct TierCode *Tier;
+    
+    // Whether Def is pure, if it was found out at PureGeneration, and the
+    // IsPureFunction walk that last visited it.
+    int Pure;
+    int PureGeneration;
+    int PureWalk;
+};
+
+/// FindFunctionEntry - The entry for Name, or NULL if nothing with a name on
+/// its page has been defined yet.
+static struct FunctionEntry *FindFunctionEntry(int Name) {
+    struct FunctionEntry *Page = Ctx->FunctionPages[Name >> SYMBOL_PAGE_BITS];
+    return Page ? &Page[Name & (SYMBOL_PAGE_SIZE - 1)] : NULL;
+}
+
+static struct FunctionEntry *GetFunctionEntry(int Name) {
+    struct FunctionEntry **Page = &Ctx->FunctionPages[Name >> SYMBOL_PAGE_BITS];
+    if (!*Page) {
+        *Page = (struct FunctionEntry *)
+            calloc(SYMBOL_PAGE_SIZE, sizeof(struct FunctionEntry));
+    }
+    return &(*Page)[Name & (SYMBOL_PAGE_SIZE - 1)];
+}
+
+/// FindNativeFunction - Look up the C function an extern prototype names.
+static const struct NativeFunction *FindNativeFunction(struct PrototypeAST *P) {
+    for (int i = 0; i < NUM_NATIVE_FUNCTIONS; i++) {
+        const struct NativeFunction *F = &NativeFunctions[i];
+        if (F->NumArgs == P->NumArgs && !strcmp(F->Name, SymbolName(P->Name))) {
+            return F;
+        }
+    }
+    return NULL;
+}
+
+/// Scope - The loop variables in scope, innermost first.  Loop variable I
+/// levels deep lives in frame slot NumArgs + I, after the arguments; sibling
+/// loops share their slots.
+struct Scope {
+    int Name;
+    int Slot;
+    int Type;
+    const struct Scope *Outer;
+};
+
+/// Resolver - The state of ResolveFunction.
+struct Resolver {
+    struct FunctionAST *F;
+    const struct Scope *Locals;
+    int NumLocals;
+};
+
+/// BuildCastExpr - E converted to Type.  A literal is converted in place
+/// when that gives the value converting it at run time would, and anything
+/// else gets a cast node.
+static struct ExprAST *BuildCastExpr(struct ExprAST *E, int Type) {
+    if (E->Type == Type) {
+        return E;
+    }
+    if (E->Kind == expr_number) {
+        struct NumberExprAST *N = (struct NumberExprAST *) E;
+        if (Type != type_i64 || fabs(N->Val) < 0x1p63) {
+            N->Val = Type == type_i64 ? trunc(N->Val) :
+                     Type == type_f32 ? (float) N->Val : N->Val;
+            E->Type = Type;
+            return E;
+        }
+    }
+    ALLOC_EXPR(Result, CastExprAST, expr_cast);
+    Result->Base.Type = Type;
+    Result->Operand = E;
+    return &Result->Base;
+}
+
+/// LiteralType - The type literal N takes on next to a value of type Type:
+/// that type, unless N is not a whole number of the i64 range and Type is i64.
+static int LiteralType(const struct ExprAST *N, int Type) {
+    double Val = ((const struct NumberExprAST *) N)->Val;
+    if (Type == type_i64 && (Val != trunc(Val) || !(fabs(Val) < 0x1p63))) {
+        return type_f64;
+    }
+    return Type;
+}
+
+/// CommonType - The type an operation on L and R is carried out in: the
+/// greater of their types, except that a literal takes on the other
+/// operand's type where it can.
+static int CommonType(const struct ExprAST *L, const struct ExprAST *R) {
+    if (L->Kind == expr_number && R->Kind != expr_number) {
+        return LiteralType(L, R->Type);
+    }
+    if (R->Kind == expr_number && L->Kind != expr_number) {
+        return LiteralType(R, L->Type);
+    }
+    return L->Type > R->Type ? L->Type : R->Type;
+}
+
+/// ResolveExpr - Bind every variable reference in E to its frame slot, so the
+/// evaluator never has to look names up, and give every node of E its type.
+/// Operands are converted to the type their operation is carried out in,
+/// conditions to f64, and call arguments to the types of the callee's
+/// parameters, if it is known yet; otherwise they are taken to be f64 and
+/// the evaluator checks at the call that they are.  Returns 0 on error.
+static int ResolveExpr(struct ExprAST *E, struct Resolver *R) {
+    switch (E->Kind) {
+        case expr_number:
+        case expr_cast:
+            return 1;
+        case expr_variable: {
+            struct VariableExprAST *V = (struct VariableExprAST *) E;
+            for (const struct Scope *S = R->Locals; S; S = S->Outer) {
+                if (S->Name == V->Name) {
+                    V->Slot = S->Slot;
+                    E->Type = (unsigned char) S->Type;
+                    return 1;
+                }
+            }
+            const struct PrototypeAST *Proto = R->F->Proto;
+            for (int i = 0; i < Proto->NumArgs; i++) {
+                if (Proto->Args[i] == V->Name) {
+                    V->Slot = i;
+                    E->Type = (unsigned char) ArgType(Proto, i);
+                    return 1;
+                }
+            }
+            Error("Unknown variable name");
+            return 0;
+        }
+        case expr_binary: {
+            struct BinaryExprAST *B = (struct BinaryExprAST *) E;
+            if (!ResolveExpr(B->LHS, R) || !ResolveExpr(B->RHS, R)) {
+                return 0;
+            }
+            int Type = CommonType(B->LHS, B->RHS);
+            B->LHS = BuildCastExpr(B->LHS, Type);
+            B->RHS = BuildCastExpr(B->RHS, Type);
+            E->Type = (unsigned char) Type;
+            return 1;
+        }
+        case expr_call: {
+            struct CallExprAST *C = (struct CallExprAST *) E;
+            const struct PrototypeAST *P = R->F->Proto;
+            if (C->Callee != P->Name) {
+                const struct FunctionEntry *Entry = FindFunctionEntry(C->Callee);
+                P = Entry ? Entry->Proto : NULL;
+            }
+            if (P && P->NumArgs != C->NumArgs) {
+                P = NULL; // Left for the back end to report.
+            }
+            for (int i = 0; i < C->NumArgs; i++) {
+                if (!ResolveExpr(C->Args[i], R)) {
+                    return 0;
+                }
+                C->Args[i] = BuildCastExpr(C->Args[i],
+                                           P ? ArgType(P, i) : type_f64);
+            }
+            C->Sig = P ? P->Sig : 0;
+            E->Type = P ? P->RetType : type_f64;
+            return 1;
+        }
+        case expr_if: {
+            struct IfExprAST *If = (struct IfExprAST *) E;
+            if (!ResolveExpr(If->Cond, R) || !ResolveExpr(If->Then, R) ||
+                !ResolveExpr(If->Else, R)) {
+                return 0;
+            }
+            int Type = CommonType(If->Then, If->Else);
+            If->Cond = BuildCastExpr(If->Cond, type_f64);
+            If->Then = BuildCastExpr(If->Then, Type);
+            If->Else = BuildCastExpr(If->Else, Type);
+            E->Type = (unsigned char) Type;
+            return 1;
+        }
+        case expr_for: {
+            // The start value is outside the loop variable's scope.
+            struct ForExprAST *For = (struct ForExprAST *) E;
+            if (!ResolveExpr(For->Start, R)) {
+                return 0;
+            }
+            if (For->VarType < 0) {
+                For->VarType = For->Start->Type;
+            }
+            For->Start = BuildCastExpr(For->Start, For->VarType);
+            For->Slot = R->F->Proto->NumArgs + R->NumLocals;
+            if (For->Slot >= R->F->NumSlots) {
+                R->F->NumSlots = For->Slot + 1;
+            }
+            struct Scope Var = { For->VarName, For->Slot, For->VarType, R->Locals };
+            R->Locals = &Var;
+            R->NumLocals++;
+            int Ok = ResolveExpr(For->End, R) &&
+                     (!For->Step || ResolveExpr(For->Step, R)) &&
+                     ResolveExpr(For->Body, R);
+            R->Locals = Var.Outer;
+            R->NumLocals--;
+            if (Ok) {
+                For->End = BuildCastExpr(For->End, type_f64);
+                if (For->Step) {
+                    For->Step = BuildCastExpr(For->Step, For->VarType);
+                }
+            }
+            return Ok;
+        }
+    }
+    return 0;
+}
+
+static int ResolveFunction(struct FunctionAST *F) {
+    struct Resolver R = { F, NULL, 0 };
+    F->NumSlots = F->Proto->NumArgs;
+    if (!ResolveExpr(F->Body, &R)) {
+        return 0;
+    }
+    F->Body = BuildCastExpr(F->Body, F->Proto->RetType);
+    return 1;
+}
+
+/// The evaluator walks the AST directly.  Arguments for each call are
+/// evaluated into a frame on the fixed EvalStack, and the callee's body reads
+/// them from there by slot, so calls never touch the heap.  Each frame has
+/// room after the arguments for the callee's loop variables, which loops
+/// update in place.  Runtime errors unwind straight back to EvalFunction.
+static void EvalError(const char *Str) __attribute__((noreturn));
+static void EvalError(const char *Str) {
+    Error(Str);
+    longjmp(Ctx->EvalErrorJmp, 1);
+}
+
+/// Values of every type are held in doubles, so frames and registers need
+/// no tags: f64 and f32 values as themselves, and i64 values as their bits.
+static double IntCell(int64_t I) {
+    double D;
+    memcpy(&D, &I, sizeof(D));
+    return D;
+}
+
+static int64_t CellInt(double D) {
+    int64_t I;
+    memcpy(&I, &D, sizeof(I));
+    return I;
+}
+
+/// TypedOne - The value 1 of type Type, a loop's default step.
+static double TypedOne(int Type) {
+    return Type == type_i64 ? IntCell(1) : 1.0;
+}
+
+/// ConvertValue - Convert V from type From to type To as the JIT does: to the
+/// nearest value, except that conversion to i64 truncates and saturates at
+/// the ends of its range, with NaN going to 0.
+static double ConvertValue(double V, int From, int To) {
+    if (From == To) {
+        return V;
+    } else if (From == type_i64) {
+        int64_t I = CellInt(V);
+        return To == type_f32 ? (double) (float) I : (double) I;
+    } else if (To == type_i64) {
+        return IntCell(V != V ? 0 : V >= 0x1p63 ? INT64_MAX :
+                       V < -0x1p63 ? INT64_MIN : (int64_t) V);
+    }
+    return To == type_f32 ? (double) (float) V : V;
+}
+
+/// EvalBinary - L Op R for values of type Type.  i64 arithmetic wraps around.
+static double EvalBinary(int Op, int Type, double L, double R) {
+    if (Type == type_i64) {
+        uint64_t A = (uint64_t) CellInt(L), B = (uint64_t) CellInt(R);
+        switch (Op) {
+            case '+': return IntCell((int64_t) (A + B));
+            case '-': return IntCell((int64_t) (A - B));
+            case '*': return IntCell((int64_t) (A * B));
+            case '<': return IntCell((int64_t) A < (int64_t) B);
+        }
+    } else if (Type == type_f32) {
+        float A = (float) L, B = (float) R;
+        switch (Op) {
+            case '+': return (float) (A + B);
+            case '-': return (float) (A - B);
+            case '*': return (float) (A * B);
+            case '<': return A < B ? 1.0 : 0.0;
+        }
+    } else {
+        switch (Op) {
+            case '+': return L + R;
+            case '-': return L - R;
+            case '*': return L * R;
+            case '<': return L < R ? 1.0 : 0.0;
+        }
+    }
+    EvalError("invalid binary operator");
+}
+
+static double CallNative(const struct NativeFunction *F, const double *Args) {
+    switch (F->NumArgs) {
+        case 0: return ((double (*)(void)) F->Fn)();
+        case 1: return ((double (*)(double)) F->Fn)(Args[0]);
+        case 2: return ((double (*)(double, double)) F->Fn)(Args[0], Args[1]);
+        default:
+            return ((double (*)(double, double, double)) F->Fn)(Args[0], Args[1],
+                                                                 Args[2]);
+    }
+}
+
+static double EvalExpr(const struct ExprAST *E, double *Frame) {
+    switch (E->Kind) {
+        case expr_number: {
+            const struct NumberExprAST *N = (const struct NumberExprAST *) E;
+            return E->Type == type_i64 ? IntCell((int64_t) N->Val) : N->Val;
+        }
+            
+        case expr_variable:
+            return Frame[((const struct VariableExprAST *) E)->Slot];
+            
+        case expr_binary: {
+            const struct BinaryExprAST *B = (const struct BinaryExprAST *) E;
+            double L = EvalExpr(B->LHS, Frame);
+            double R = EvalExpr(B->RHS, Frame);
+            if (E->Type != type_f64) {
+                return EvalBinary(B->Op, E->Type, L, R);
+            }
+            switch (B->Op) {
+                case '+': return L + R;
+                case '-': return L - R;
+                case '*': return L * R;
+                case '<': return L < R ? 1.0 : 0.0;
+            }
+            EvalError("invalid binary operator");
+        }
+            
+        case expr_call: {
+            const struct CallExprAST *C = (const struct CallExprAST *) E;
+            const struct FunctionEntry *F = FindFunctionEntry(C->Callee);
+            if (!F || !F->Proto) {
+                EvalError("Unknown function referenced");
+            }
+            if (F->Proto->NumArgs != C->NumArgs) {
+                EvalError("Incorrect # arguments passed");
+            }
+            if (F->Proto->Sig != C->Sig) {
+                EvalError("Incorrect argument types passed");
+            }
+            
+            // Reserve the callee's frame before evaluating into it, so calls
+            // made while computing the arguments stack above it.
+            double *Args = Ctx->EvalSP;
+            int FrameSize = F->Native ? C->NumArgs : F->Def->NumSlots;
+            if (Args + FrameSize > Ctx->EvalStack + EVAL_STACK_SIZE ||
+                Ctx->EvalDepth == EVAL_MAX_DEPTH) {
+                EvalError("Stack overflow");
+            }
+            Ctx->EvalSP = Args + FrameSize;
+            for (int i = 0; i < C->NumArgs; i++) {
+                Args[i] = EvalExpr(C->Args[i], Frame);
+            }
+            
+            double Result;
+            if (F->Native) {
+                Result = CallNative(F->Native, Args);
+            } else {
+                Ctx->EvalDepth++;
+                Result = EvalExpr(F->Def->Body, Args);
+                Ctx->EvalDepth--;
+            }
+            Ctx->EvalSP = Args;
+            return Result;
+        }
+            
+        case expr_if: {
+            const struct IfExprAST *If = (const struct IfExprAST *) E;
+            if (EvalExpr(If->Cond, Frame) != 0.0) {
+                return EvalExpr(If->Then, Frame);
+            }
+            return EvalExpr(If->Else, Frame);
+        }
+            
+        case expr_for: {
+            // The body runs at least once.  The end condition is tested after
+            // the step has been evaluated, while the variable still has the
+            // value the body saw.  The loop itself evaluates to 0.
+            const struct ForExprAST *For = (const struct ForExprAST *) E;
+            double *Var = &Frame[For->Slot];
+            *Var = EvalExpr(For->Start, Frame);
+            while (1) {
+                EvalExpr(For->Body, Frame);
+                double Step = For->Step ? EvalExpr(For->Step, Frame)
+                                        : TypedOne(For->VarType);
+                double End = EvalExpr(For->End, Frame);
+                if (For->VarType == type_f64) {
+                    *Var += Step;
+                } else {
+                    *Var = EvalBinary('+', For->VarType, *Var, Step);
+                }
+                if (End == 0.0) {
+                    return 0;
+                }
+            }
+        }
+            
+        case expr_cast: {
+            const struct ExprAST *Operand =
+                ((const struct CastExprAST *) E)->Operand;
+            return ConvertValue(EvalExpr(Operand, Frame), Operand->Type, E->Type);
+        }
+    }
+    EvalError("invalid expression");
+    return 0;
+}
+
+/// EvalFunction - Run a zero-argument function such as __anon_expr.  Returns
+/// 0 if it failed with a runtime error.
+static int EvalFunction(struct FunctionAST *F, double *Result) {
+    Ctx->EvalSP = Ctx->EvalStack + F->NumSlots;
+    Ctx->EvalDepth = 0;
+    if (setjmp(Ctx->EvalErrorJmp)) {
+        return 0;
+    }
+    *Result = EvalExpr(F->Body, Ctx->EvalStack);
+    return 1;
+}
+
+#pragma mark Inliner
+
+/// Before a definition or top-level expression is handed to a back end, calls
+/// to small defs are replaced by the callee's body with the arguments
+/// substituted for its parameters, and folded with BuildBinaryExpr.  A call
+/// is inlined when the result has no more than InlineThreshold nodes, so
+/// constant arguments specialize a callee that is too big to inline as it
+/// stands when they fold it down that far.
+///
+/// The inlined copy is what the back ends see as FunctionEntry::Def; the
+/// function as written is kept as Source.  Each definition records the defs
+/// it inlined, directly or through a callee's inlined body, along with their
+/// DefStamp at the time, so that redefining one of them rebuilds it.
+
+/// InlineDep - A def whose body was inlined, and its DefStamp when it was.
+struct InlineDep {
+    int Name;
+    int Stamp;
+};
+
+/// InlineInfo - What InlineCall needs to know about a callee: the number of
+/// nodes in its body, counting no further than 4 * InlineThreshold, and how
+/// often the body uses each argument.
+struct InlineInfo {
+    int Size;
+    int Uses[];
+};
+
+/// Inliner - The state of InlineFunction.
+struct Inliner {
+    int Self; // The function being inlined into; recursive calls are kept.
+    struct InlineDep *Deps;
+    int NumDeps, DepsCapacity;
+    struct InlineDep LocalDeps[16];
+};
+
+/// DependsOn - Entry's Def has Name's body inlined into it.  Such a callee is
+/// never inlined back into Name, so inlining never runs in a cycle.
+static int DependsOn(const struct FunctionEntry *Entry, int Name) {
+    for (int i = 0; i < Entry->NumInlineDeps; i++) {
+        if (Entry->InlineDeps[i].Name == Name) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void AddInlineDep(struct Inliner *In, int Name, int Stamp) {
+    for (int i = 0; i < In->NumDeps; i++) {
+        if (In->Deps[i].Name == Name) {
+            return;
+        }
+    }
+    if (In->NumDeps == In->DepsCapacity) {
+        In->DepsCapacity *= 2;
+        struct InlineDep *Deps = (struct InlineDep *)
+            malloc(In->DepsCapacity * sizeof(struct InlineDep));
+        memcpy(Deps, In->Deps, In->NumDeps * sizeof(struct InlineDep));
+        if (In->Deps != In->LocalDeps) {
+            free(In->Deps);
+        }
+        In->Deps = Deps;
+    }
+    In->Deps[In->NumDeps].Name = Name;
+    In->Deps[In->NumDeps].Stamp = Stamp;
+    In->NumDeps++;
+}
+
+/// ExprSize - The number of nodes in E, counting no further than Limit.
+static int ExprSize(const struct ExprAST *E, int Limit) {
+    switch (E->Kind) {
+        case expr_number:
+        case expr_variable:
+            return 1;
+        case expr_cast:
+            return 1 + ExprSize(((const struct CastExprAST *) E)->Operand, Limit);
+        case expr_binary: {
+            const struct BinaryExprAST *B = (const struct BinaryExprAST *) E;
+            int Size = 1 + ExprSize(B->LHS, Limit);
+            return Size > Limit ? Size : Size + ExprSize(B->RHS, Limit - Size);
+        }
+        case expr_call: {
+            const struct CallExprAST *C = (const struct CallExprAST *) E;
+            int Size = 1;
+            for (int i = 0; i < C->NumArgs && Size <= Limit; i++) {
+                Size += ExprSize(C->Args[i], Limit - Size);
+            }
+            return Size;
+        }
+        case expr_if: {
+            const struct IfExprAST *If = (const struct IfExprAST *) E;
+            int Size = 1 + ExprSize(If->Cond, Limit);
+            if (Size <= Limit) {
+                Size += ExprSize(If->Then, Limit - Size);
+            }
+            return Size > Limit ? Size : Size + ExprSize(If->Else, Limit - Size);
+        }
+        case expr_for: {
+            const struct ForExprAST *For = (const struct ForExprAST *) E;
+            const struct ExprAST *Parts[] = {
+                For->Start, For->End, For->Body, For->Step
+            };
+            int Size = 1;
+            for (int i = 0; i < (For->Step ? 4 : 3) && Size <= Limit; i++) {
+                Size += ExprSize(Parts[i], Limit - Size);
+            }
+            return Size;
+        }
+    }
+    return 1;
+}
+
+/// HasCall - E makes a call, or has a loop, which might never finish.
+static int HasCall(const struct ExprAST *E) {
+    switch (E->Kind) {
+        case expr_number:
+        case expr_variable:
+            return 0;
+        case expr_cast:
+            return HasCall(((const struct CastExprAST *) E)->Operand);
+        case expr_binary: {
+            const struct BinaryExprAST *B = (const struct BinaryExprAST *) E;
+            return HasCall(B->LHS) || HasCall(B->RHS);
+        }
+        case expr_if: {
+            const struct IfExprAST *If = (const struct IfExprAST *) E;
+            return HasCall(If->Cond) || HasCall(If->Then) || HasCall(If->Else);
+        }
+        case expr_call:
+        case expr_for:
+            return 1;
+    }
+    return 1;
+}
+
+static void CountUses(const struct ExprAST *E, int *Uses) {
+    switch (E->Kind) {
+        case expr_number:
+            break;
+        case expr_variable:
+            Uses[((const struct VariableExprAST *) E)->Slot]++;
+            break;
+        case expr_cast:
+            CountUses(((const struct CastExprAST *) E)->Operand, Uses);
+            break;
+        case expr_binary: {
+            const struct BinaryExprAST *B = (const struct BinaryExprAST *) E;
+            CountUses(B->LHS, Uses);
+            CountUses(B->RHS, Uses);
+            break;
+        }
+        case expr_call: {
+            const struct CallExprAST *C = (const struct CallExprAST *) E;
+            for (int i = 0; i < C->NumArgs; i++) {
+                CountUses(C->Args[i], Uses);
+            }
+            break;
+        }
+        case expr_if: {
+            const struct IfExprAST *If = (const struct IfExprAST *) E;
+            CountUses(If->Cond, Uses);
+            CountUses(If->Then, Uses);
+            CountUses(If->Else, Uses);
+            break;
+        }
+        case expr_for:
+            break; // Not inlined; see AnalyzeFunction.
+    }
+}
+
+/// AnalyzeFunction - F's InlineInfo, in CurArena, or NULL if F is never to
+/// be inlined: its loop variables have slots in its own frame.
+static struct InlineInfo *AnalyzeFunction(const struct FunctionAST *F) {
+    int NumArgs = F->Proto->NumArgs;
+    if (F->NumSlots > NumArgs) {
+        return NULL;
+    }
+    struct InlineInfo *Info = (struct InlineInfo *)
+        ArenaAlloc(Ctx->CurArena, sizeof(struct InlineInfo) +
+                   NumArgs * sizeof(int));
+    Info->Size = ExprSize(F->Body, 4 * Ctx->InlineThreshold);
+    memset(Info->Uses, 0, NumArgs * sizeof(int));
+    CountUses(F->Body, Info->Uses);
+    return Info;
+}
+
+/// CopyNumber - A copy of literal E in CurArena.
+static struct ExprAST *CopyNumber(const struct ExprAST *E) {
+    ALLOC_EXPR(Result, NumberExprAST, expr_number);
+    Result->Base.Type = E->Type;
+    Result->Val = ((const struct NumberExprAST *) E)->Val;
+    return &Result->Base;
+}
+
+/// BuildIfExpr - Make the node for if Cond then Then else Else, or just the
+/// branch taken if Cond is a constant.  Like BuildBinaryExpr, the node made
+/// is f64.
+static struct ExprAST *BuildIfExpr(struct ExprAST *Cond, struct ExprAST *Then,
+                                   struct ExprAST *Else) {
+    if (Cond->Kind == expr_number) {
+        return ((struct NumberExprAST *) Cond)->Val != 0.0 ? Then : Else;
+    }
+    ALLOC_EXPR(Result, IfExprAST, expr_if);
+    Result->Cond = Cond;
+    Result->Then = Then;
+    Result->Else = Else;
+    return &Result->Base;
+}
+
+/// SubstituteExpr - A copy of the callee expression E in CurArena, with
+/// Args in place of its parameters.  Nothing of E is shared, since the
+/// callee's arena goes away when it is redefined, and constant arguments are
+/// copied too, since BuildBinaryExpr folds into its LHS.
+static struct ExprAST *SubstituteExpr(const struct ExprAST *E,
+                                      struct ExprAST **Args) {
+    struct ExprAST *Result = NULL;
+    switch (E->Kind) {
+        case expr_number:
+            return CopyNumber(E);
+        case expr_variable: {
+            struct ExprAST *Arg = Args[((const struct VariableExprAST *) E)->Slot];
+            return Arg->Kind == expr_number ? CopyNumber(Arg) : Arg;
+        }
+        case expr_binary: {
+            const struct BinaryExprAST *B = (const struct BinaryExprAST *) E;
+            struct ExprAST *LHS = SubstituteExpr(B->LHS, Args);
+            Result = BuildBinaryExpr(B->Op, LHS, SubstituteExpr(B->RHS, Args));
+            break;
+        }
+        case expr_call: {
+            const struct CallExprAST *C = (const struct CallExprAST *) E;
+            ALLOC_EXPR_ARGS(Call, CallExprAST, expr_call, C->NumArgs);
+            Call->Callee = C->Callee;
+            Call->Sig = C->Sig;
+            for (int i = 0; i < C->NumArgs; i++) {
+                Call->Args[i] = SubstituteExpr(C->Args[i], Args);
+            }
+            Result = &Call->Base;
+            break;
+        }
+        case expr_if: {
+            const struct IfExprAST *If = (const struct IfExprAST *) E;
+            struct ExprAST *Cond = SubstituteExpr(If->Cond, Args);
+            struct ExprAST *Then = SubstituteExpr(If->Then, Args);
+            Result = BuildIfExpr(Cond, Then, SubstituteExpr(If->Else, Args));
+            break;
+        }
+        case expr_for:
+            return NULL; // Not inlined; see AnalyzeFunction.
+        case expr_cast:
+            return BuildCastExpr(
+                SubstituteExpr(((const struct CastExprAST *) E)->Operand, Args),
+                E->Type);
+    }
+    Result->Type = E->Type;
+    return Result;
+}
+
+/// InlineCall - The body of callee Entry with Args substituted, or NULL if
+/// the call should be kept.  An argument that is used more than once in the
+/// body must be a constant or a variable, so no work is duplicated, and one
+/// with a call in it is never substituted, so calls keep their order.
+static struct ExprAST *InlineCall(const struct FunctionEntry *Entry,
+                                  struct ExprAST **Args) {
+    const struct InlineInfo *Info = Entry->Inline;
+    int Threshold = Ctx->InlineThreshold;
+    int Bound = Info->Size; // On the size of the result without folding.
+    int Constant = 0;
+    for (int i = 0; i < Entry->Proto->NumArgs; i++) {
+        int Trivial = Args[i]->Kind == expr_number ||
+                      Args[i]->Kind == expr_variable;
+        int Uses = Info->Uses[i];
+        if ((Uses > 1 && !Trivial) || (!Trivial && HasCall(Args[i]))) {
+            return NULL;
+        }
+        if (Uses && !Trivial) {
+            Bound += ExprSize(Args[i], 4 * Threshold) - 1;
+        }
+        Constant |= Uses && Args[i]->Kind == expr_number;
+    }
+    
+    // Specialization: with constant arguments the body may still fold down
+    // under the threshold.  Bodies much bigger than it are not tried.
+    if (Bound > Threshold && (!Constant || Bound > 4 * Threshold)) {
+        return NULL;
+    }
+    struct ArenaMark Mark = ArenaGetMark(Ctx->CurArena);
+    struct ExprAST *Body = SubstituteExpr(Entry->Def->Body, Args);
+    if (Bound > Threshold && ExprSize(Body, Threshold) > Threshold) {
+        ArenaRelease(Ctx->CurArena, Mark);
+        return NULL;
+    }
+    return Body;
+}
+
+/// InlineExpr - E with the calls in it inlined.  Nodes of E that do not
+/// change are shared.
+static struct ExprAST *InlineExpr(struct ExprAST *E, struct Inliner *In) {
+    switch (E->Kind) {
+        case expr_number:
+        case expr_variable:
+            return E;
+        case expr_binary: {
+            struct BinaryExprAST *B = (struct BinaryExprAST *) E;
+            struct ExprAST *LHS = InlineExpr(B->LHS, In);
+            struct ExprAST *RHS = InlineExpr(B->RHS, In);
+            if (LHS == B->LHS && RHS == B->RHS) {
+                return E;
+            }
+            if (LHS->Kind == expr_number) {
+                LHS = CopyNumber(LHS); // It may be shared, as a branch of an if.
+            }
+            struct ExprAST *Result = BuildBinaryExpr(B->Op, LHS, RHS);
+            Result->Type = E->Type;
+            return Result;
+        }
+        case expr_call: {
+            struct CallExprAST *C = (struct CallExprAST *) E;
+            struct ExprAST *Args[C->NumArgs + 1];
+            int Changed = 0;
+            for (int i = 0; i < C->NumArgs; i++) {
+                Args[i] = InlineExpr(C->Args[i], In);
+                Changed |= Args[i] != C->Args[i];
+            }
+            
+            const struct FunctionEntry *Entry = FindFunctionEntry(C->Callee);
+            if (Entry && Entry->Def && Entry->Inline && C->Callee != In->Self &&
+                Entry->Proto->NumArgs == C->NumArgs &&
+                Entry->Proto->Sig == C->Sig && !DependsOn(Entry, In->Self)) {
+                struct ExprAST *Body = InlineCall(Entry, Args);
+                if (Body) {
+                    AddInlineDep(In, C->Callee, Entry->DefStamp);
+                    for (int i = 0; i < Entry->NumInlineDeps; i++) {
+                        AddInlineDep(In, Entry->InlineDeps[i].Name,
+                                     Entry->InlineDeps[i].Stamp);
+                    }
+                    return Body;
+                }
+            }
+            if (!Changed) {
+                return E;
+            }
+            ALLOC_EXPR_ARGS(Result, CallExprAST, expr_call, C->NumArgs);
+            Result->Base.Type = E->Type;
+            Result->Callee = C->Callee;
+            Result->Sig = C->Sig;
+            memcpy(Result->Args, Args, C->NumArgs * sizeof(struct ExprAST *));
+            return &Result->Base;
+        }
+        case expr_if: {
+            struct IfExprAST *If = (struct IfExprAST *) E;
+            struct ExprAST *Cond = InlineExpr(If->Cond, In);
+            struct ExprAST *Then = InlineExpr(If->Then, In);
+            struct ExprAST *Else = InlineExpr(If->Else, In);
+            if (Cond == If->Cond && Then == If->Then && Else == If->Else) {
+                return E;
+            }
+            struct ExprAST *Result = BuildIfExpr(Cond, Then, Else);
+            Result->Type = E->Type;
+            return Result;
+        }
+        case expr_for: {
+            struct ForExprAST *For = (struct ForExprAST *) E;
+            struct ExprAST *Start = InlineExpr(For->Start, In);
+            struct ExprAST *End = InlineExpr(For->End, In);
+            struct ExprAST *Step = For->Step ? InlineExpr(For->Step, In) : NULL;
+            struct ExprAST *Body = InlineExpr(For->Body, In);
+            if (Start == For->Start && End == For->End && Step == For->Step &&
+                Body == For->Body) {
+                return E;
+            }
+            ALLOC_EXPR(Result, ForExprAST, expr_for);
+            Result->VarName = For->VarName;
+            Result->Slot = For->Slot;
+            Result->VarType = For->VarType;
+            Result->Start = Start;
+            Result->End = End;
+            Result->Step = Step;
+            Result->Body = Body;
+            return &Result->Base;
+        }
+        case expr_cast: {
+            struct CastExprAST *Cast = (struct CastExprAST *) E;
+            struct ExprAST *Operand = InlineExpr(Cast->Operand, In);
+            if (Operand == Cast->Operand) {
+                return E;
+            }
+            if (Operand->Kind == expr_number) {
+                Operand = CopyNumber(Operand);
+            }
+            return BuildCastExpr(Operand, E->Type);
+        }
+    }
+    return E;
+}
+
+/// InlineFunction - F with its calls inlined, in CurArena, or F itself if
+/// nothing changed.  The defs it inlined are stored in *Deps, also in
+/// CurArena, and their number is returned in *NumDeps.
+static struct FunctionAST *InlineFunction(struct FunctionAST *F,
+                                          struct InlineDep **Deps,
+                                          int *NumDeps) {
+    struct Inliner In;
+    In.Self = F->Proto->Name;
+    In.Deps = In.LocalDeps;
+    In.NumDeps = 0;
+    In.DepsCapacity = sizeof(In.LocalDeps) / sizeof(In.LocalDeps[0]);
+    struct ExprAST *Body = InlineExpr(F->Body, &In);
+    *NumDeps = In.NumDeps;
+    *Deps = NULL;
+    if (In.NumDeps) {
+        *Deps = (struct InlineDep *)
+            ArenaAlloc(Ctx->CurArena, In.NumDeps * sizeof(struct InlineDep));
+        memcpy(*Deps, In.Deps, In.NumDeps * sizeof(struct InlineDep));
+    }
+    if (In.Deps != In.LocalDeps) {
+        free(In.Deps);
+    }
+    if (Body == F->Body) {
+        return F;
+    }
+    
+    ALLOC_STRUCT(Result, FunctionAST);
+    Result->Proto = F->Proto;
+    Result->Body = Body;
+    Result->NumSlots = F->NumSlots;
+    return Result;
+}
+
+#pragma mark Flat AST
+
+/// With --flat-ast the tree back end does not walk the parsed AST itself.
+/// Each body is copied, once it has been resolved, into a FlatExpr: one
+/// contiguous pool with the node kinds, operators and operands in parallel
+/// arrays, and children referred to by 32-bit index rather than by pointer.
+/// Nodes are stored in post-order, so a node's operands always come before
+/// it and a body without control flow is evaluated by a single forward scan.
+/// Conditionals and loops add nodes that jump forwards or backwards in it.
+
+/// FlatKind - The node kinds only flattened bodies have, after the ExprKinds.
+enum FlatKind {
+    flat_branch = expr_cast + 1,
+    flat_jump,
+    flat_init,
+    flat_binary_f32,
+    flat_binary_i64
+};
+
+/// FlatExpr - A flattened function body.  For node I:
+///   number:   A[I] indexes Consts.
+///   variable: A[I] is the frame slot.
+///   binary:   Op[I] is the operator, A[I] and B[I] the operand nodes.  The
+///             binary kind is for f64 operands, binary_f32 and binary_i64
+///             for the others.
+///   cast:     A[I] is the operand node, of type Op[I] / NUM_TYPES, to be
+///             converted to type Op[I] % NUM_TYPES.
+///   call:     A[I] is the callee; Operands[B[I]] is the number of
+///             arguments, followed by the Sig of the call, and their nodes.
+///   branch:   Jump to node B[I] if node A[I] is 0.
+///   jump:     Store node A[I] as node B[I] - 1 and jump to node B[I].
+///   if:       Laid out as the condition, a branch to the else part, the
+///             then part and a jump past the if node, the else part, and
+///             the if node itself, which takes node A[I], the else value.
+///   init:     Set frame slot A[I] to node B[I], a loop's start value.
+///   for:      Laid out as the start value, an init node, the body, the step
+///             and the end condition, then the for node: Op[I] is the loop
+///             variable's type, A[I] the end condition and Operands[B[I]]
+///             the variable's slot, then the step node (-1 for 1) and the
+///             first node of the body.
+/// The last node is the root.
+struct FlatExpr {
+    int NumNodes;
+    int NumSlots; // Of the frame; see FunctionAST.
+    unsigned char *Kind;
+    unsigned char *Op;
+    int32_t *A;
+    int32_t *B;
+    double *Consts;
+    int32_t *Operands;
+};
+
+/// FlatBuilder - Where FlattenNode is in each of the FlatExpr's arrays.
+struct FlatBuilder {
+    struct FlatExpr *Flat;
+    int NumNodes, NumConsts, NumOperands;
+};
+
+/// CountFlat - Add up the space E takes in each array of a FlatExpr.
+static void CountFlat(const struct ExprAST *E, struct FlatBuilder *Size) {
+    Size->NumNodes++;
+    switch (E->Kind) {
+        case expr_number:
+            Size->NumConsts++;
+            break;
+        case expr_variable:
+            break;
+        case expr_cast:
+            CountFlat(((const struct CastExprAST *) E)->Operand, Size);
+            break;
+        case expr_binary: {
+            const struct BinaryExprAST *B = (const struct BinaryExprAST *) E;
+            CountFlat(B->LHS, Size);
+            CountFlat(B->RHS, Size);
+            break;
+        }
+        case expr_call: {
+            const struct CallExprAST *C = (const struct CallExprAST *) E;
+            Size->NumOperands += 2 + C->NumArgs;
+            for (int i = 0; i < C->NumArgs; i++) {
+                CountFlat(C->Args[i], Size);
+            }
+            break;
+        }
+        case expr_if: {
+            const struct IfExprAST *If = (const struct IfExprAST *) E;
+            Size->NumNodes += 2; // The branch and the jump.
+            CountFlat(If->Cond, Size);
+            CountFlat(If->Then, Size);
+            CountFlat(If->Else, Size);
+            break;
+        }
+        case expr_for: {
+            const struct ForExprAST *For = (const struct ForExprAST *) E;
+            Size->NumNodes++; // The init node.
+            Size->NumOperands += 3;
+            CountFlat(For->Start, Size);
+            CountFlat(For->End, Size);
+            if (For->Step) {
+                CountFlat(For->Step, Size);
+            }
+            CountFlat(For->Body, Size);
+            break;
+        }
+    }
+}
+
+/// AddFlatNode - Append a node to the FlatExpr, returning its index.
+static int AddFlatNode(struct FlatBuilder *FB, int Kind, int Op, int A, int B) {
+    struct FlatExpr *Flat = FB->Flat;
+    int I = FB->NumNodes++;
+    Flat->Kind[I] = (unsigned char) Kind;
+    Flat->Op[I] = (unsigned char) Op;
+    Flat->A[I] = A;
+    Flat->B[I] = B;
+    return I;
+}
+
+/// FlattenNode - Append E and its operands to the FlatExpr, returning the
+/// index of E's node.
+static int FlattenNode(const struct ExprAST *E, struct FlatBuilder *FB) {
+    struct FlatExpr *Flat = FB->Flat;
+    int Kind = E->Kind, A = 0, B = 0, Op = 0;
+    switch (E->Kind) {
+        case expr_number: {
+            double Val = ((const struct NumberExprAST *) E)->Val;
+            A = FB->NumConsts;
+            Flat->Consts[A] = E->Type == type_i64 ? IntCell((int64_t) Val) : Val;
+            FB->NumConsts++;
+            break;
+        }
+        case expr_variable:
+            A = ((const struct VariableExprAST *) E)->Slot;
+            break;
+        case expr_binary: {
+            const struct BinaryExprAST *Bin = (const struct BinaryExprAST *) E;
+            Op = (unsigned char) Bin->Op;
+            A = FlattenNode(Bin->LHS, FB);
+            B = FlattenNode(Bin->RHS, FB);
+            if (E->Type != type_f64) {
+                Kind = E->Type == type_f32 ? flat_binary_f32 : flat_binary_i64;
+            }
+            break;
+        }
+        case expr_cast: {
+            const struct ExprAST *Operand =
+                ((const struct CastExprAST *) E)->Operand;
+            Op = Operand->Type * NUM_TYPES + E->Type;
+            A = FlattenNode(Operand, FB);
+            break;
+        }
+        case expr_call: {
+            const struct CallExprAST *C = (const struct CallExprAST *) E;
+            A = C->Callee;
+            B = FB->NumOperands;
+            FB->NumOperands += 2 + C->NumArgs;
+            Flat->Operands[B] = C->NumArgs;
+            Flat->Operands[B + 1] = C->Sig;
+            for (int i = 0; i < C->NumArgs; i++) {
+                Flat->Operands[B + 2 + i] = FlattenNode(C->Args[i], FB);
+            }
+            break;
+        }
+        case expr_if: {
+            const struct IfExprAST *If = (const struct IfExprAST *) E;
+            int Cond = FlattenNode(If->Cond, FB);
+            int Branch = AddFlatNode(FB, flat_branch, 0, Cond, 0);
+            int Then = FlattenNode(If->Then, FB);
+            int Jump = AddFlatNode(FB, flat_jump, 0, Then, 0);
+            Flat->B[Branch] = FB->NumNodes;
+            A = FlattenNode(If->Else, FB);
+            Flat->B[Jump] = FB->NumNodes + 1; // Past the if node.
+            break;
+        }
+        case expr_for: {
+            const struct ForExprAST *For = (const struct ForExprAST *) E;
+            int Start = FlattenNode(For->Start, FB);
+            AddFlatNode(FB, flat_init, 0, For->Slot, Start);
+            Op = For->VarType;
+            B = FB->NumOperands;
+            FB->NumOperands += 3;
+            Flat->Operands[B] = For->Slot;
+            Flat->Operands[B + 2] = FB->NumNodes;
+            FlattenNode(For->Body, FB);
+            Flat->Operands[B + 1] = For->Step ? FlattenNode(For->Step, FB) : -1;
+            A = FlattenNode(For->End, FB);
+            break;
+        }
+    }
+    
+    return AddFlatNode(FB, Kind, Op, A, B);
+}
+
+/// FlattenFunction - F's resolved body as a FlatExpr in CurArena.
+static struct FlatExpr *FlattenFunction(const struct FunctionAST *F) {
+    struct FlatBuilder Size = { NULL, 0, 0, 0 };
+    CountFlat(F->Body, &Size);
+    
+    ALLOC_STRUCT(Flat, FlatExpr);
+    struct Arena *A = Ctx->CurArena;
+    Flat->NumNodes = Size.NumNodes;
+    Flat->NumSlots = F->NumSlots;
+    Flat->Kind = (unsigned char *) ArenaAlloc(A, Size.NumNodes);
+    Flat->Op = (unsigned char *) ArenaAlloc(A, Size.NumNodes);
+    Flat->A = (int32_t *) ArenaAlloc(A, Size.NumNodes * sizeof(int32_t));
+    Flat->B = (int32_t *) ArenaAlloc(A, Size.NumNodes * sizeof(int32_t));
+    Flat->Consts = (double *) ArenaAlloc(A, Size.NumConsts * sizeof(double));
+    Flat->Operands = (int32_t *)
+        ArenaAlloc(A, Size.NumOperands * sizeof(int32_t));
+    
+    struct FlatBuilder FB = { Flat, 0, 0, 0 };
+    FlattenNode(F->Body, &FB);
+    return Flat;
+}
+
+/// EvalFlat - Evaluate a flattened body whose frame is Frame.  The value of
+/// every node goes into a scratch array on EvalStack, above which the frames
+/// of the calls it makes are stacked.
+static double EvalFlat(const struct FlatExpr *Flat, double *Frame) {
+    double *V = Ctx->EvalSP;
+    if (V + Flat->NumNodes > Ctx->EvalStack + EVAL_STACK_SIZE) {
+        EvalError("Stack overflow");
+    }
+    Ctx->EvalSP = V + Flat->NumNodes;
+    
+    for (int I = 0; I < Flat->NumNodes; I++) {
+        int32_t A = Flat->A[I];
+        switch (Flat->Kind[I]) {
+            case expr_number:
+                V[I] = Flat->Consts[A];
+                break;
+                
+            case expr_variable:
+                V[I] = Frame[A];
+                break;
+                
+            case expr_binary: {
+                double L = V[A];
+                double R = V[Flat->B[I]];
+                switch (Flat->Op[I]) {
+                    case '+': V[I] = L + R; break;
+                    case '-': V[I] = L - R; break;
+                    case '*': V[I] = L * R; break;
+                    case '<': V[I] = L < R ? 1.0 : 0.0; break;
+                    default: EvalError("invalid binary operator");
+                }
+                break;
+            }
+                
+            case flat_binary_f32:
+                V[I] = EvalBinary(Flat->Op[I], type_f32, V[A], V[Flat->B[I]]);
+                break;
+                
+            case flat_binary_i64:
+                V[I] = EvalBinary(Flat->Op[I], type_i64, V[A], V[Flat->B[I]]);
+                break;
+                
+            case expr_cast:
+                V[I] = ConvertValue(V[A], Flat->Op[I] / NUM_TYPES,
+                                    Flat->Op[I] % NUM_TYPES);
+                break;
+                
+            case expr_call: {
+                const int32_t *Operands = Flat->Operands + Flat->B[I];
+                int NumArgs = Operands[0];
+                const struct FunctionEntry *F = FindFunctionEntry(A);
+                if (!F || !F->Proto) {
+                    EvalError("Unknown function referenced");
+                }
+                if (F->Proto->NumArgs != NumArgs) {
+                    EvalError("Incorrect # arguments passed");
+                }
+                if (F->Proto->Sig != Operands[1]) {
+                    EvalError("Incorrect argument types passed");
+                }
+                
+                double *Args = Ctx->EvalSP;
+                int FrameSize = F->Native ? NumArgs : F->Flat->NumSlots;
+                if (Args + FrameSize > Ctx->EvalStack + EVAL_STACK_SIZE ||
+                    Ctx->EvalDepth == EVAL_MAX_DEPTH) {
+                    EvalError("Stack overflow");
+                }
+                Ctx->EvalSP = Args + FrameSize;
+                for (int i = 0; i < NumArgs; i++) {
+                    Args[i] = V[Operands[2 + i]];
+                }
+                
+                if (F->Native) {
+                    V[I] = CallNative(F->Native, Args);
+                } else {
+                    Ctx->EvalDepth++;
+                    V[I] = EvalFlat(F->Flat, Args);
+                    Ctx->EvalDepth--;
+                }
+                Ctx->EvalSP = Args;
+                break;
+            }
+                
+            case flat_branch:
+                if (V[A] == 0.0) {
+                    I = Flat->B[I] - 1;
+                }
+                break;
+                
+            case flat_jump:
+                I = Flat->B[I] - 1;
+                V[I] = V[A];
+                break;
+                
+            case expr_if:
+                V[I] = V[A];
+                break;
+                
+            case flat_init:
+                Frame[A] = V[Flat->B[I]];
+                break;
+                
+            case expr_for: {
+                const int32_t *Operands = Flat->Operands + Flat->B[I];
+                int Step = Operands[1], Type = Flat->Op[I];
+                double *Var = &Frame[Operands[0]];
+                if (Type == type_f64) {
+                    *Var += Step < 0 ? 1.0 : V[Step];
+                } else {
+                    *Var = EvalBinary('+', Type, *Var,
+                                      Step < 0 ? TypedOne(Type) : V[Step]);
+                }
+                if (V[A] != 0.0) {
+                    I = Operands[2] - 1;
+                } else {
+                    V[I] = 0;
+                }
+                break;
+            }
+                
+            default:
+                EvalError("invalid expression");
+        }
+    }
+    
+    Ctx->EvalSP = V;
+    return V[Flat->NumNodes - 1];
+}
+
+/// EvalFlatFunction - EvalFunction for a flattened zero-argument function.
+static int EvalFlatFunction(const struct FlatExpr *Flat, double *Result) {
+    Ctx->EvalSP = Ctx->EvalStack + Flat->NumSlots;
+    Ctx->EvalDepth = 0;
+    if (setjmp(Ctx->EvalErrorJmp)) {
+        return 0;
+    }
+    *Result = EvalFlat(Flat, Ctx->EvalStack);
+    return 1;
+}
+
+#pragma mark Bytecode VM
+
+/// The VM back end lowers each function to a flat array of register
+/// instructions.  A function's frame slots, its arguments and then its loop
+/// variables, live in registers 0..NumSlots-1 and temporaries are allocated
+/// above them in stack order.  A call evaluates its arguments into
+/// consecutive registers starting at A, and the callee's register window
+/// starts right there, so arguments are never copied.  Conditionals and loops
+/// jump within the array.  Arithmetic comes in a group of opcodes for each
+/// type; see TypedOp.
+enum Opcode {
+    op_loadk, // R[A] = Constants[B]
+    op_mov,   // R[A] = R[B]
+    op_add,   // R[A] = R[B] + R[C]
+    op_sub,   // R[A] = R[B] - R[C]
+    op_mul,   // R[A] = R[B] * R[C]
+    op_lt,    // R[A] = R[B] < R[C]
+    op_add_f32, op_sub_f32, op_mul_f32, op_lt_f32, // The same for f32,
+    op_add_i64, op_sub_i64, op_mul_i64, op_lt_i64, // and for i64.
+    op_cvt,   // R[A] = R[B] from type C / NUM_TYPES to type C % NUM_TYPES
+    op_call,  // R[A] = Callees[B](R[A] .. R[A+C-1])
+    op_jmp,   // goto B
+    op_jf,    // if R[A] == 0 goto B
+    op_jt,    // if R[A] != 0 goto B
+    op_ret    // return R[A]
+};
+
+struct Instr {
+    unsigned char Op;
+    unsigned short A, B, C;
+};
+
+#define MAX_OPERAND 0xffff
+
+/// Bytecode - A function compiled for the VM.  Constants and callees are
+/// pooled per function and referenced by index from the instructions;
+/// Callees holds each callee's name followed by the Sig its calls expect.
+struct Bytecode {
+    struct Instr *Code;
+    double *Constants;
+    int *Callees;
+    int NumRegs;
+};
+
+static int EmitInstr(int Op, int A, int B, int C) {
+    if (A > MAX_OPERAND || B > MAX_OPERAND || C > MAX_OPERAND) {
+        Error("function too large for the bytecode VM");
+        return 0;
+    }
+    if (Ctx->NumCode == Ctx->CodeCapacity) {
+        Ctx->CodeCapacity = Ctx->CodeCapacity ? Ctx->CodeCapacity * 2 : 256;
+        Ctx->CodeBuf = (struct Instr *)
+            realloc(Ctx->CodeBuf, Ctx->CodeCapacity * sizeof(struct Instr));
+    }
+    struct Instr *I = &Ctx->CodeBuf[Ctx->NumCode++];
+    I->Op = Op;
+    I->A = A;
+    I->B = B;
+    I->C = C;
+    return 1;
+}
+
+static int AddConstant(double Val) {
+    for (int i = 0; i < Ctx->NumConsts; i++) {
+        if (!memcmp(&Ctx->ConstBuf[i], &Val, sizeof(double))) {
+            return i;
+        }
+    }
+    if (Ctx->NumConsts == Ctx->ConstCapacity) {
+        Ctx->ConstCapacity = Ctx->ConstCapacity ? Ctx->ConstCapacity * 2 : 64;
+        Ctx->ConstBuf = (double *)
+            realloc(Ctx->ConstBuf, Ctx->ConstCapacity * sizeof(double));
+    }
+    Ctx->ConstBuf[Ctx->NumConsts] = Val;
+    return Ctx->NumConsts++;
+}
+
+static int AddCallee(int Name, int Sig) {
+    for (int i = 0; i < Ctx->NumCallees; i++) {
+        if (Ctx->CalleeBuf[2 * i] == Name && Ctx->CalleeBuf[2 * i + 1] == Sig) {
+            return i;
+        }
+    }
+    if (Ctx->NumCallees == Ctx->CalleeCapacity) {
+        Ctx->CalleeCapacity = Ctx->CalleeCapacity ? Ctx->CalleeCapacity * 2 : 16;
+        Ctx->CalleeBuf = (int *)
+            realloc(Ctx->CalleeBuf, Ctx->CalleeCapacity * 2 * sizeof(int));
+    }
+    Ctx->CalleeBuf[2 * Ctx->NumCallees] = Name;
+    Ctx->CalleeBuf[2 * Ctx->NumCallees + 1] = Sig;
+    return Ctx->NumCallees++;
+}
+
+/// TypedOp - The opcode for arithmetic Op, one of op_add to op_lt, on values
+/// of type Type.
+static int TypedOp(int Op, int Type) {
+    return Op + (Type == type_f32 ? op_add_f32 - op_add :
+                 Type == type_i64 ? op_add_i64 - op_add : 0);
+}
+
+static void UseReg(int Reg) {
+    if (Reg + 1 > Ctx->MaxReg) {
+        Ctx->MaxReg = Reg + 1;
+    }
+}
+
+static int CompileInto(const struct ExprAST *E, int Reg);
+
+/// CompileExpr - Emit code for E using registers from Top upwards as
+/// temporaries.  Returns the register holding the result (a frame slot's
+/// register for a plain variable reference, Top otherwise), or -1 on error.
+static int CompileExpr(const struct ExprAST *E, int Top) {
+    switch (E->Kind) {
+        case expr_number: {
+            double Val = ((const struct NumberExprAST *) E)->Val;
+            if (E->Type == type_i64) {
+                Val = IntCell((int64_t) Val);
+            }
+            UseReg(Top);
+            return EmitInstr(op_loadk, Top, AddConstant(Val), 0) ? Top : -1;
+        }
+            
+        case expr_variable:
+            return ((const struct VariableExprAST *) E)->Slot;
+            
+        case expr_binary: {
+            const struct BinaryExprAST *B = (const struct BinaryExprAST *) E;
+            int Op;
+            switch (B->Op) {
+                case '+': Op = op_add; break;
+                case '-': Op = op_sub; break;
+                case '*': Op = op_mul; break;
+                case '<': Op = op_lt; break;
+                default:
+                    Error("invalid binary operator");
+                    return -1;
+            }
+            
+            int L = CompileExpr(B->LHS, Top);
+            if (L < 0) {
+                return -1;
+            }
+            int R = CompileExpr(B->RHS, L == Top ? Top + 1 : Top);
+            if (R < 0) {
+                return -1;
+            }
+            UseReg(Top);
+            return EmitInstr(TypedOp(Op, E->Type), Top, L, R) ? Top : -1;
+        }
+            
+        case expr_cast: {
+            const struct ExprAST *Operand =
+                ((const struct CastExprAST *) E)->Operand;
+            int Src = CompileExpr(Operand, Top);
+            UseReg(Top);
+            if (Src < 0 || !EmitInstr(op_cvt, Top, Src,
+                                      Operand->Type * NUM_TYPES + E->Type)) {
+                return -1;
+            }
+            return Top;
+        }
+            
+        case expr_call: {
+            const struct CallExprAST *C = (const struct CallExprAST *) E;
+            for (int i = 0; i < C->NumArgs; i++) {
+                int Arg = CompileExpr(C->Args[i], Top + i);
+                if (Arg < 0) {
+                    return -1;
+                }
+                if (Arg != Top + i) {
+                    UseReg(Top + i);
+                    if (!EmitInstr(op_mov, Top + i, Arg, 0)) {
+                        return -1;
+                    }
+                }
+            }
+            UseReg(Top);
+            if (!EmitInstr(op_call, Top, AddCallee(C->Callee, C->Sig),
+                           C->NumArgs)) {
+                return -1;
+            }
+            return Top;
+        }
+            
+        case expr_if: {
+            const struct IfExprAST *If = (const struct IfExprAST *) E;
+            int Cond = CompileExpr(If->Cond, Top);
+            int Branch = Ctx->NumCode;
+            if (Cond < 0 || !EmitInstr(op_jf, Cond, 0, 0) ||
+                !CompileInto(If->Then, Top)) {
+                return -1;
+            }
+            int Jump = Ctx->NumCode;
+            if (!EmitInstr(op_jmp, 0, 0, 0)) {
+                return -1;
+            }
+            Ctx->CodeBuf[Branch].B = Ctx->NumCode;
+            if (!CompileInto(If->Else, Top)) {
+                return -1;
+            }
+            if (Ctx->NumCode > MAX_OPERAND) {
+                Error("function too large for the bytecode VM");
+                return -1;
+            }
+            Ctx->CodeBuf[Jump].B = Ctx->NumCode;
+            return Top;
+        }
+            
+        case expr_for: {
+            // The loop variable's register is its frame slot.  The step goes
+            // into Top while the end condition is computed above it.
+            const struct ForExprAST *For = (const struct ForExprAST *) E;
+            int Start = CompileExpr(For->Start, Top);
+            if (Start < 0 || !EmitInstr(op_mov, For->Slot, Start, 0)) {
+                return -1;
+            }
+            int Loop = Ctx->NumCode;
+            if (CompileExpr(For->Body, Top) < 0) {
+                return -1;
+            }
+            int Step;
+            if (For->Step) {
+                Step = CompileExpr(For->Step, Top);
+            } else {
+                UseReg(Top);
+                Step = EmitInstr(op_loadk, Top,
+                                 AddConstant(TypedOne(For->VarType)), 0) ? Top : -1;
+            }
+            if (Step < 0) {
+                return -1;
+            }
+            int End = CompileExpr(For->End, Step == Top ? Top + 1 : Top);
+            UseReg(Top);
+            int Add = TypedOp(op_add, For->VarType);
+            if (End < 0 || !EmitInstr(Add, For->Slot, For->Slot, Step) ||
+                !EmitInstr(op_jt, End, Loop, 0) ||
+                !EmitInstr(op_loadk, Top, AddConstant(0.0), 0)) {
+                return -1;
+            }
+            return Top;
+        }
+    }
+    return -1;
+}
+
+/// CompileInto - Emit code for E that leaves its value in Reg, using the
+/// registers from Reg upwards.  Returns 0 on error.
+static int CompileInto(const struct ExprAST *E, int Reg) {
+    int Result = CompileExpr(E, Reg);
+    if (Result < 0) {
+        return 0;
+    }
+    UseReg(Reg);
+    return Result == Reg || EmitInstr(op_mov, Reg, Result, 0);
+}
+
+/// CompileFunction - Lower a resolved function to bytecode allocated from
+/// CurArena.  Returns NULL on error.
+static struct Bytecode *CompileFunction(const struct FunctionAST *F) {
+    Ctx->NumCode = Ctx->NumConsts = Ctx->NumCallees = 0;
+    Ctx->MaxReg = F->NumSlots;
+    enum Phase Prev = EnterPhase(phase_codegen);
+    
+    int Result = CompileExpr(F->Body, F->NumSlots);
+    if (Result < 0 || !EmitInstr(op_ret, Result, 0, 0)) {
+        EnterPhase(Prev);
+        return NULL;
+    }
+    
+    ALLOC_STRUCT(Code, Bytecode);
+    Code->Code = (struct Instr *)
+        ArenaAlloc(Ctx->CurArena, Ctx->NumCode * sizeof(struct Instr));
+    memcpy(Code->Code, Ctx->CodeBuf, Ctx->NumCode * sizeof(struct Instr));
+    Code->Constants = (double *)
+        ArenaAlloc(Ctx->CurArena, Ctx->NumConsts * sizeof(double));
+    memcpy(Code->Constants, Ctx->ConstBuf, Ctx->NumConsts * sizeof(double));
+    Code->Callees = (int *)
+        ArenaAlloc(Ctx->CurArena, Ctx->NumCallees * 2 * sizeof(int));
+    memcpy(Code->Callees, Ctx->CalleeBuf, Ctx->NumCallees * 2 * sizeof(int));
+    Code->NumRegs = Ctx->MaxReg;
+    EnterPhase(Prev);
+    return Code;
+}
+
+static void QueueTierUp(struct FunctionEntry *Entry);
+
+/// TieredCode - The native code F has been tiered up to, if it is still
+/// current.  Otherwise the call about to run F's bytecode is counted, and F
+/// is queued for the tier-up thread once it has been called TierThreshold
+/// times since any function last changed.
+static const struct TierCode *TieredCode(struct FunctionEntry *F) {
+    const struct TierCode *T = __atomic_load_n(&F->Tier, __ATOMIC_ACQUIRE);
+    if (T && T->Generation == Ctx->DefGeneration) {
+        return T;
+    }
+    if (F->CallsGeneration != Ctx->DefGeneration) {
+        F->CallsGeneration = Ctx->DefGeneration;
+        F->Calls = 0;
+    }
+    if (++F->Calls == Ctx->TierThreshold) {
+        QueueTierUp(F);
+    }
+    return NULL;
+}
+
+/// RunBytecode - Execute Code with its register window starting at R.  The
+/// VM shares EvalStack, EvalDepth and the error unwinding with the tree
+/// walker.
+static double RunBytecode(const struct Bytecode *Code, double *R) {
+    const struct Instr *I = Code->Code;
+    for (;; I++) {
+        switch (I->Op) {
+            case op_loadk:
+                R[I->A] = Code->Constants[I->B];
+                break;
+            case op_mov:
+                R[I->A] = R[I->B];
+                break;
+            case op_add:
+                R[I->A] = R[I->B] + R[I->C];
+                break;
+            case op_sub:
+                R[I->A] = R[I->B] - R[I->C];
+                break;
+            case op_mul:
+                R[I->A] = R[I->B] * R[I->C];
+                break;
+            case op_lt:
+                R[I->A] = R[I->B] < R[I->C] ? 1.0 : 0.0;
+                break;
+            case op_add_f32:
+                R[I->A] = EvalBinary('+', type_f32, R[I->B], R[I->C]);
+                break;
+            case op_sub_f32:
+                R[I->A] = EvalBinary('-', type_f32, R[I->B], R[I->C]);
+                break;
+            case op_mul_f32:
+                R[I->A] = EvalBinary('*', type_f32, R[I->B], R[I->C]);
+                break;
+            case op_lt_f32:
+                R[I->A] = EvalBinary('<', type_f32, R[I->B], R[I->C]);
+                break;
+            case op_add_i64:
+                R[I->A] = EvalBinary('+', type_i64, R[I->B], R[I->C]);
+                break;
+            case op_sub_i64:
+                R[I->A] = EvalBinary('-', type_i64, R[I->B], R[I->C]);
+                break;
+            case op_mul_i64:
+                R[I->A] = EvalBinary('*', type_i64, R[I->B], R[I->C]);
+                break;
+            case op_lt_i64:
+                R[I->A] = EvalBinary('<', type_i64, R[I->B], R[I->C]);
+                break;
+            case op_cvt:
+                R[I->A] = ConvertValue(R[I->B], I->C / NUM_TYPES, I->C % NUM_TYPES);
+                break;
+            case op_call: {
+                int Name = Code->Callees[2 * I->B];
+                struct FunctionEntry *F = FindFunctionEntry(Name);
+                if (!F || !F->Proto) {
+                    EvalError("Unknown function referenced");
+                }
+                if (F->Proto->NumArgs != I->C) {
+                    EvalError("Incorrect # arguments passed");
+                }
+                if (F->Proto->Sig != Code->Callees[2 * I->B + 1]) {
+                    EvalError("Incorrect argument types passed");
+                }
+                
+                double *Args = R + I->A;
+                if (F->Native) {
+                    R[I->A] = CallNative(F->Native, Args);
+                    break;
+                }
+                const struct TierCode *T;
+                if (Ctx->TierThreshold && (T = TieredCode(F))) {
+                    R[I->A] = T->Fn(Args);
+                    break;
+                }
+                if (Args + F->Code->NumRegs > Ctx->EvalStack + EVAL_STACK_SIZE ||
+                    Ctx->EvalDepth == EVAL_MAX_DEPTH) {
+                    EvalError("Stack overflow");
+                }
+                Ctx->EvalDepth++;
+                R[I->A] = RunBytecode(F->Code, Args);
+                Ctx->EvalDepth--;
+                break;
+            }
+            case op_jmp:
+                I = Code->Code + I->B - 1;
+                break;
+            case op_jf:
+                if (R[I->A] == 0.0) {
+                    I = Code->Code + I->B - 1;
+                }
+                break;
+            case op_jt:
+                if (R[I->A] != 0.0) {
+                    I = Code->Code + I->B - 1;
+                }
+                break;
+            case op_ret:
+                return R[I->A];
+        }
+    }
+}
+
+/// RunFunction - Run a zero-argument bytecode function such as __anon_expr.
+/// Returns 0 if it failed with a runtime error.
+static int RunFunction(const struct Bytecode *Code, double *Result) {
+    Ctx->EvalDepth = 0;
+    if (Code->NumRegs > EVAL_STACK_SIZE) {
+        Error("Stack overflow");
+        return 0;
+    }
+    if (setjmp(Ctx->EvalErrorJmp)) {
+        return 0;
+    }
+    *Result = RunBytecode(Code, Ctx->EvalStack);
+    return 1;
+}
+
+#pragma mark Code Generation
+
+/// The JIT back end emits LLVM IR for each definition and top-level
+/// expression into a fresh module in TheContext, then hands the module to
+/// the JIT.  Functions defined in earlier modules are re-declared in the
+/// current one from their recorded prototype when they are called.
+///
+/// The code generator state is per thread: batch compile workers each
+/// generate into a context and module of their own.
+static __thread LLVMContextRef TheContext;
+static __thread LLVMModuleRef TheModule;
+static __thread LLVMBuilderRef Builder;
+static __thread LLVMTypeRef DoubleTy;
+static __thread int CurFunctionName; // Proto name of the function being built.
+
+/// NamedValues - The value of each frame slot of the function being built:
+/// its parameters, then the phi nodes of the loop variables in scope.
+static __thread LLVMValueRef *NamedValues;
+
+
+static LLVMValueRef ErrorV(const char *Str) {
+    Error(Str);
+    return NULL;
+}
+
+/// ValueTy - The LLVM type of values of type Type.
+static LLVMTypeRef ValueTy(int Type) {
+    switch (Type) {
+        case type_i64: return LLVMInt64TypeInContext(TheContext);
+        case type_f32: return LLVMFloatTypeInContext(TheContext);
+    }
+    return DoubleTy;
+}
+
+/// FunctionType - Make the function type P describes:  double(double,float)
+/// etc.
+static LLVMTypeRef FunctionType(const struct PrototypeAST *P) {
+    LLVMTypeRef Params[P->NumArgs + 1];
+    for (int i = 0; i < P->NumArgs; i++) {
+        Params[i] = ValueTy(ArgType(P, i));
+    }
+    return LLVMFunctionType(ValueTy(P->RetType), Params, P->NumArgs, 0);
+}
+
+/// BuildConvert - Convert V from type From to type To, as ConvertValue does.
+static LLVMValueRef BuildConvert(LLVMValueRef V, int From, int To) {
+    if (From == To) {
+        return V;
+    } else if (From == type_i64) {
+        return LLVMBuildSIToFP(Builder, V, ValueTy(To), "convtmp");
+    } else if (To == type_i64) {
+        // Unlike fptosi, which gives poison out of range, this saturates.
+        static const char Name[] = "llvm.fptosi.sat";
+        unsigned ID = LLVMLookupIntrinsicID(Name, sizeof(Name) - 1);
+        LLVMTypeRef Types[2] = { ValueTy(To), ValueTy(From) };
+        LLVMValueRef F = LLVMGetIntrinsicDeclaration(TheModule, ID, Types, 2);
+        LLVMTypeRef FT = LLVMIntrinsicGetType(TheContext, ID, Types, 2);
+        return LLVMBuildCall2(Builder, FT, F, &V, 1, "convtmp");
+    } else if (To == type_f32) {
+        return LLVMBuildFPTrunc(Builder, V, ValueTy(To), "convtmp");
+    }
+    return LLVMBuildFPExt(Builder, V, ValueTy(To), "convtmp");
+}
+
+/// CodegenProto - Declare the function P describes in TheModule as Name.
+static LLVMValueRef CodegenProto(const struct PrototypeAST *P,
+                                 const char *Name) {
+    LLVMValueRef F = LLVMAddFunction(TheModule, Name, FunctionType(P));
+    
+    // Set names for all arguments.
+    for (int i = 0; i < P->NumArgs; i++) {
+        const struct Symbol *Arg = GetSymbol(P->Args[i]);
+        LLVMSetValueName2(LLVMGetParam(F, i), Arg->Name, Arg->Len);
+    }
+    return F;
+}
+
+/// GetFunction - Find the function called Name in TheModule, declaring it
+/// from its last definition or extern if it lives in an earlier module.
+static LLVMValueRef GetFunction(int Name) {
+    LLVMValueRef F = LLVMGetNamedFunction(TheModule, SymbolName(Name));
+    if (F) {
+        return F;
+    }
+    const struct FunctionEntry *Entry = FindFunctionEntry(Name);
+    if (Entry && Entry->Proto) {
+        return CodegenProto(Entry->Proto, SymbolName(Name));
+    }
+    return NULL;
+}
+
+/// GetCallSlot - Declare the NAME.slot pointer to the code of def Name.
+static LLVMValueRef GetCallSlot(int Name, LLVMTypeRef FT) {
+    const char *FnName = SymbolName(Name);
+    char SlotName[strlen(FnName) + sizeof(".slot")];
+    sprintf(SlotName, "%s.slot", FnName);
+    LLVMValueRef Slot = LLVMGetNamedGlobal(TheModule, SlotName);
+    if (!Slot) {
+        Slot = LLVMAddGlobal(TheModule, LLVMPointerType(FT, 0), SlotName);
+    }
+    return Slot;
+}
+
+static LLVMValueRef CodegenExpr(const struct ExprAST *E, LLVMValueRef Fn) {
+    switch (E->Kind) {
+        case expr_number: {
+            double Val = ((const struct NumberExprAST *) E)->Val;
+            if (E->Type == type_i64) {
+                return LLVMConstInt(ValueTy(type_i64), (int64_t) Val, 1);
+            }
+            return LLVMConstReal(ValueTy(E->Type), Val);
+        }
+            
+        case expr_variable:
+            return NamedValues[((const struct VariableExprAST *) E)->Slot];
+            
+        case expr_binary: {
+            const struct BinaryExprAST *B = (const struct BinaryExprAST *) E;
+            LLVMValueRef L = CodegenExpr(B->LHS, Fn);
+            LLVMValueRef R = CodegenExpr(B->RHS, Fn);
+            if (!L || !R) {
+                return NULL;
+            }
+            
+            if (E->Type == type_i64) {
+                switch (B->Op) {
+                    case '+':
+                        return LLVMBuildAdd(Builder, L, R, "addtmp");
+                    case '-':
+                        return LLVMBuildSub(Builder, L, R, "subtmp");
+                    case '*':
+                        return LLVMBuildMul(Builder, L, R, "multmp");
+                    case '<':
+                        L = LLVMBuildICmp(Builder, LLVMIntSLT, L, R, "cmptmp");
+                        return LLVMBuildZExt(Builder, L, ValueTy(type_i64),
+                                             "booltmp");
+                }
+                return ErrorV("invalid binary operator");
+            }
+            switch (B->Op) {
+                case '+':
+                    return LLVMBuildFAdd(Builder, L, R, "addtmp");
+                case '-':
+                    return LLVMBuildFSub(Builder, L, R, "subtmp");
+                case '*':
+                    return LLVMBuildFMul(Builder, L, R, "multmp");
+                case '<':
+                    // Ordered, so that NaN compares as 0 as it does in C.
+                    L = LLVMBuildFCmp(Builder, LLVMRealOLT, L, R, "cmptmp");
+                    // Convert bool 0/1 to double 0.0 or 1.0
+                    return LLVMBuildUIToFP(Builder, L, ValueTy(E->Type),
+                                           "booltmp");
+            }
+            return ErrorV("invalid binary operator");
+        }
+            
+        case expr_cast: {
+            const struct ExprAST *Operand =
+                ((const struct CastExprAST *) E)->Operand;
+            LLVMValueRef V = CodegenExpr(Operand, Fn);
+            return V ? BuildConvert(V, Operand->Type, E->Type) : NULL;
+        }
+            
+        case expr_call: {
+            const struct CallExprAST *C = (const struct CallExprAST *) E;
+            const struct FunctionEntry *Entry = FindFunctionEntry(C->Callee);
+            LLVMValueRef CalleeF;
+            LLVMTypeRef FT;
+            if (C->Callee == CurFunctionName) {
+                // Recursion always calls the version being built.
+                CalleeF = Fn;
+                FT = LLVMGlobalGetValueType(Fn);
+            } else if (Ctx->UseCallSlots && Entry && Entry->Def) {
+                FT = FunctionType(Entry->Proto);
+                CalleeF = LLVMBuildLoad2(Builder, LLVMPointerType(FT, 0),
+                                         GetCallSlot(C->Callee, FT), "calleeptr");
+            } else {
+                // Look up the name in the global module table.
+                if (!(CalleeF = GetFunction(C->Callee))) {
+                    return ErrorV("Unknown function referenced");
+                }
+                FT = LLVMGlobalGetValueType(CalleeF);
+            }
+            
+            // If argument mismatch error.
+            if ((int) LLVMCountParamTypes(FT) != C->NumArgs) {
+                return ErrorV("Incorrect # arguments passed");
+            }
+            if (C->Callee != CurFunctionName && Entry && Entry->Proto &&
+                Entry->Proto->Sig != C->Sig) {
+                return ErrorV("Incorrect argument types passed");
+            }
+            
+            LLVMValueRef ArgsV[C->NumArgs + 1];
+            for (int i = 0; i < C->NumArgs; i++) {
+                if (!(ArgsV[i] = CodegenExpr(C->Args[i], Fn))) {
+                    return NULL;
+                }
+            }
+            return LLVMBuildCall2(Builder, FT, CalleeF, ArgsV, C->NumArgs,
+                                  "calltmp");
+        }
+            
+        case expr_if: {
+            const struct IfExprAST *If = (const struct IfExprAST *) E;
+            LLVMValueRef Cond = CodegenExpr(If->Cond, Fn);
+            if (!Cond) {
+                return NULL;
+            }
+            
+            // Convert condition to a bool by comparing non-equal to 0.0.
+            Cond = LLVMBuildFCmp(Builder, LLVMRealUNE, Cond,
+                                 LLVMConstReal(DoubleTy, 0.0), "ifcond");
+            LLVMBasicBlockRef ThenBB =
+                LLVMAppendBasicBlockInContext(TheContext, Fn, "then");
+            LLVMBasicBlockRef ElseBB =
+                LLVMAppendBasicBlockInContext(TheContext, Fn, "else");
+            LLVMBasicBlockRef MergeBB =
+                LLVMAppendBasicBlockInContext(TheContext, Fn, "ifcont");
+            LLVMBuildCondBr(Builder, Cond, ThenBB, ElseBB);
+            
+            // Each branch may end in a different block than it started in,
+            // if it has control flow of its own.
+            LLVMValueRef Values[2];
+            LLVMBasicBlockRef Blocks[2];
+            LLVMPositionBuilderAtEnd(Builder, ThenBB);
+            if (!(Values[0] = CodegenExpr(If->Then, Fn))) {
+                return NULL;
+            }
+            LLVMBuildBr(Builder, MergeBB);
+            Blocks[0] = LLVMGetInsertBlock(Builder);
+            
+            LLVMPositionBuilderAtEnd(Builder, ElseBB);
+            if (!(Values[1] = CodegenExpr(If->Else, Fn))) {
+                return NULL;
+            }
+            LLVMBuildBr(Builder, MergeBB);
+            Blocks[1] = LLVMGetInsertBlock(Builder);
+            
+            LLVMPositionBuilderAtEnd(Builder, MergeBB);
+            LLVMValueRef PN = LLVMBuildPhi(Builder, ValueTy(E->Type), "iftmp");
+            LLVMAddIncoming(PN, Values, Blocks, 2);
+            return PN;
+        }
+            
+        case expr_for: {
+            // The loop variable is a phi node in the loop header, fed by the
+            // start value on entry and by the stepped value on the back edge.
+            const struct ForExprAST *For = (const struct ForExprAST *) E;
+            LLVMValueRef Start = CodegenExpr(For->Start, Fn);
+            if (!Start) {
+                return NULL;
+            }
+            LLVMBasicBlockRef PreheaderBB = LLVMGetInsertBlock(Builder);
+            LLVMBasicBlockRef LoopBB =
+                LLVMAppendBasicBlockInContext(TheContext, Fn, "loop");
+            LLVMBuildBr(Builder, LoopBB);
+            
+            LLVMPositionBuilderAtEnd(Builder, LoopBB);
+            LLVMTypeRef VarTy = ValueTy(For->VarType);
+            LLVMValueRef Variable =
+                LLVMBuildPhi(Builder, VarTy, SymbolName(For->VarName));
+            LLVMAddIncoming(Variable, &Start, &PreheaderBB, 1);
+            NamedValues[For->Slot] = Variable;
+            
+            // The body's value is ignored; the end condition is tested with
+            // the variable still at the value the body saw.
+            if (!CodegenExpr(For->Body, Fn)) {
+                return NULL;
+            }
+            LLVMValueRef Step =
+                For->Step ? CodegenExpr(For->Step, Fn) :
+                For->VarType == type_i64 ? LLVMConstInt(VarTy, 1, 0)
+                                         : LLVMConstReal(VarTy, 1.0);
+            if (!Step) {
+                return NULL;
+            }
+            LLVMValueRef NextVar =
+                For->VarType == type_i64
+                    ? LLVMBuildAdd(Builder, Variable, Step, "nextvar")
+                    : LLVMBuildFAdd(Builder, Variable, Step, "nextvar");
+            LLVMValueRef End = CodegenExpr(For->End, Fn);
+            if (!End) {
+                return NULL;
+            }
+            End = LLVMBuildFCmp(Builder, LLVMRealUNE, End,
+                                LLVMConstReal(DoubleTy, 0.0), "loopcond");
+            
+            LLVMBasicBlockRef LoopEndBB = LLVMGetInsertBlock(Builder);
+            LLVMBasicBlockRef AfterBB =
+                LLVMAppendBasicBlockInContext(TheContext, Fn, "afterloop");
+            LLVMBuildCondBr(Builder, End, LoopBB, AfterBB);
+            LLVMPositionBuilderAtEnd(Builder, AfterBB);
+            LLVMAddIncoming(Variable, &NextVar, &LoopEndBB, 1);
+            
+            // for expr always returns 0.0.
+            return LLVMConstReal(DoubleTy, 0.0);
+        }
+    }
+    return ErrorV("invalid expression");
+}
+
+/// CodegenFunction - Emit F into TheModule as Name.  Returns NULL on error,
+/// after removing the half-built function again.
+static LLVMValueRef CodegenFunction(const struct FunctionAST *F,
+                                    const char *Name) {
+    LLVMValueRef TheFunction = LLVMGetNamedFunction(TheModule, Name);
+    if (!TheFunction) {
+        TheFunction = CodegenProto(F->Proto, Name);
+    }
+    CurFunctionName = F->Proto->Name;
+    LLVMValueRef Slots[F->NumSlots + 1];
+    for (int i = 0; i < F->NumSlots; i++) {
+        Slots[i] = i < F->Proto->NumArgs ? LLVMGetParam(TheFunction, i) : NULL;
+    }
+    NamedValues = Slots;
+    enum Phase Prev = EnterPhase(phase_codegen);
+    
+    // Create a new basic block to start insertion into.
+    LLVMBasicBlockRef BB =
+        LLVMAppendBasicBlockInContext(TheContext, TheFunction, "entry");
+    LLVMPositionBuilderAtEnd(Builder, BB);
+    
+    LLVMValueRef RetVal = CodegenExpr(F->Body, TheFunction);
+    int Ok = RetVal != NULL;
+    if (Ok) {
+        // Finish off the function.
+        LLVMBuildRet(Builder, RetVal);
+        
+        // Validate the generated code, checking for consistency.
+        Ok = !LLVMVerifyFunction(TheFunction, LLVMPrintMessageAction);
+    }
+    if (!Ok) {
+        // Error reading body, remove function.
+        LLVMDeleteFunction(TheFunction);
+        TheFunction = NULL;
+    }
+    EnterPhase(Prev);
+    return TheFunction;
+}
+
+#pragma mark JIT
+
+static __thread LLVMTargetMachineRef TheTargetMachine; // For the passes.
+
+static const char *const OptPipelines[4] = {
+    NULL,
+    "function(mem2reg,instcombine,simplifycfg)",
+    "function(mem2reg,instcombine,reassociate,gvn,simplifycfg)",
+    "default<O3>",
+};
+
+/// BatchPipelines - Used instead of OptPipelines for the single module built
+/// in batch mode, where inlining and other interprocedural passes pay off.
+static const char *const BatchPipelines[4] = {
+    NULL,
+    "default<O1>",
+    "default<O2>",
+    "default<O3>",
+};
+
+/// ErrorLLVM - Report and consume an error coming back from LLVM.
+static int ErrorLLVM(LLVMErrorRef Err) {
+    char *Msg = LLVMGetErrorMessage(Err);
+    Error(Msg);
+    LLVMDisposeErrorMessage(Msg);
+    return 0;
+}
+
+/// CreateHostTargetMachine - A target machine for the host CPU generating
+/// code with the given relocation and code models, or NULL.
+static LLVMTargetMachineRef CreateHostTargetMachine(LLVMRelocMode Reloc,
+                                                    LLVMCodeModel Model) {
+    LLVMTargetRef Target;
+    char *ErrMsg;
+    if (LLVMGetTargetFromTriple(Ctx->JITTriple, &Target, &ErrMsg)) {
+        Error(ErrMsg);
+        LLVMDisposeMessage(ErrMsg);
+        return NULL;
+    }
+    
+    char *CPU = LLVMGetHostCPUName();
+    char *Features = LLVMGetHostCPUFeatures();
+    LLVMTargetMachineRef TM = LLVMCreateTargetMachine(
+        Target, Ctx->JITTriple, CPU, Features, LLVMCodeGenLevelDefault,
+        Reloc, Model);
+    LLVMDisposeMessage(CPU);
+    LLVMDisposeMessage(Features);
+    return TM;
+}
+
+static void InitNativeTarget() {
+    LLVMInitializeNativeTarget();
+    LLVMInitializeNativeAsmPrinter();
+}
+
+/// InitJIT - Create the context's JIT, and the code generator state for the
+/// calling thread to go with it.
+static int InitJIT() {
+    static pthread_once_t TargetOnce = PTHREAD_ONCE_INIT;
+    pthread_once(&TargetOnce, InitNativeTarget);
+    
+    LLVMErrorRef Err = LLVMOrcCreateLLJIT(&Ctx->TheJIT, NULL);
+    if (Err) {
+        return ErrorLLVM(Err);
+    }
+    Ctx->MainJD = LLVMOrcLLJITGetMainJITDylib(Ctx->TheJIT);
+    
+    // Let code the optimizer turns into library calls find them in the
+    // process.  Externs written in Kaleidoscope bind to NativeFunctions.
+    LLVMOrcDefinitionGeneratorRef ProcessSymbols;
+    Err = LLVMOrcCreateDynamicLibrarySearchGeneratorForProcess(
+        &ProcessSymbols, LLVMOrcLLJITGetGlobalPrefix(Ctx->TheJIT), NULL, NULL);
+    if (Err) {
+        return ErrorLLVM(Err);
+    }
+    LLVMOrcJITDylibAddGenerator(Ctx->MainJD, ProcessSymbols);
+    
+    Ctx->JITTriple = LLVMOrcLLJITGetTripleString(Ctx->TheJIT);
+    Ctx->JITDataLayout = LLVMOrcLLJITGetDataLayoutStr(Ctx->TheJIT);
+    Ctx->MainTargetMachine =
+        CreateHostTargetMachine(LLVMRelocDefault, LLVMCodeModelJITDefault);
+    if (!Ctx->MainTargetMachine) {
+        return 0;
+    }
+    
+    Ctx->TheTSContext = LLVMOrcCreateNewThreadSafeContext();
+    Ctx->MainContext = LLVMOrcThreadSafeContextGetContext(Ctx->TheTSContext);
+    Ctx->MainBuilder = LLVMCreateBuilderInContext(Ctx->MainContext);
+    Ctx->MainDoubleTy = LLVMDoubleTypeInContext(Ctx->MainContext);
+    TheContext = Ctx->MainContext;
+    Builder = Ctx->MainBuilder;
+    DoubleTy = Ctx->MainDoubleTy;
+    TheTargetMachine = Ctx->MainTargetMachine;
+    return 1;
+}
+
+/// InitializeModule - Start a new TheModule for the next item.
+static void InitializeModule() {
+    TheModule = LLVMModuleCreateWithNameInContext("my cool jit", TheContext);
+    LLVMSetDataLayout(TheModule, Ctx->JITDataLayout);
+    LLVMSetTarget(TheModule, Ctx->JITTriple);
+}
+
+/// OptimizeModule - Run Pipeline over TheModule; NULL means no optimization.
+static int OptimizeModule(const char *Pipeline) {
+    if (!Pipeline) {
+        return 1;
+    }
+    
+    enum Phase Prev = EnterPhase(phase_optimize);
+    LLVMPassBuilderOptionsRef Options = LLVMCreatePassBuilderOptions();
+    LLVMErrorRef Err = LLVMRunPasses(TheModule, Pipeline, TheTargetMachine,
+                                     Options);
+    LLVMDisposePassBuilderOptions(Options);
+    EnterPhase(Prev);
+    return Err ? ErrorLLVM(Err) : 1;
+}
+
+/// AddModule - Transfer TheModule to the JIT, tracked by RT when it is not
+/// NULL and by the main JITDylib's default tracker otherwise.
+static int AddModule(LLVMOrcResourceTrackerRef RT) {
+    LLVMOrcThreadSafeModuleRef TSM =
+        LLVMOrcCreateNewThreadSafeModule(TheModule, Ctx->TheTSContext);
+    TheModule = NULL;
+    
+    LLVMErrorRef Err =
+        RT ? LLVMOrcLLJITAddLLVMIRModuleWithRT(Ctx->TheJIT, RT, TSM)
+           : LLVMOrcLLJITAddLLVMIRModule(Ctx->TheJIT, Ctx->MainJD, TSM);
+    return Err ? ErrorLLVM(Err) : 1;
+}
+
+/// JITLookup - Find Name in the JIT, which compiles it to machine code the
+/// first time it is looked up.
+static LLVMErrorRef JITLookup(LLVMOrcExecutorAddress *Addr, const char *Name) {
+    enum Phase Prev = EnterPhase(phase_jit);
+    LLVMErrorRef Err = LLVMOrcLLJITLookup(Ctx->TheJIT, Addr, Name);
+    EnterPhase(Prev);
+    return Err;
+}
+
+/// DefineAbsoluteSymbol - Define Name in the JIT as the address Addr.
+static int DefineAbsoluteSymbol(const char *Name, void *Addr,
+                                LLVMJITSymbolGenericFlags Flags) {
+    LLVMJITCSymbolMapPair Sym;
+    Sym.Name = LLVMOrcLLJITMangleAndIntern(Ctx->TheJIT, Name);
+    Sym.Sym.Address = (LLVMOrcExecutorAddress) (uintptr_t) Addr;
+    Sym.Sym.Flags.GenericFlags = Flags;
+    Sym.Sym.Flags.TargetFlags = 0;
+    
+    LLVMOrcMaterializationUnitRef MU = LLVMOrcAbsoluteSymbols(&Sym, 1);
+    LLVMErrorRef Err = LLVMOrcJITDylibDefine(Ctx->MainJD, MU);
+    if (Err) {
+        LLVMOrcDisposeMaterializationUnit(MU);
+        return ErrorLLVM(Err);
+    }
+    return 1;
+}
+
+/// DefineNativeSymbol - Make F callable from JIT'd code under its own name.
+static int DefineNativeSymbol(const struct NativeFunction *F) {
+    return DefineAbsoluteSymbol(F->Name, (void *) F->Fn,
+                                LLVMJITSymbolGenericFlagsExported |
+                                LLVMJITSymbolGenericFlagsCallable);
+}
+
+/// JITFunction - Compile definition F as Name and add it to the JIT, tracked
+/// by RT.
+static int JITFunction(const struct FunctionAST *F, const char *Name,
+                       LLVMOrcResourceTrackerRef RT) {
+    InitializeModule();
+    if (!CodegenFunction(F, Name) ||
+        !OptimizeModule(OptPipelines[Ctx->OptLevel])) {
+        LLVMDisposeModule(TheModule);
+        TheModule = NULL;
+        return 0;
+    }
+    return AddModule(RT);
+}
+
+/// RemoveTracker - Free the code RT tracks, then RT itself.
+static int RemoveTracker(LLVMOrcResourceTrackerRef RT) {
+    LLVMErrorRef Err = LLVMOrcResourceTrackerRemove(RT);
+    LLVMOrcReleaseResourceTracker(RT);
+    return Err ? ErrorLLVM(Err) : 1;
+}
+
+/// JITRun - Look up the zero-argument function Name in the JIT and call it.
+static int JITRun(const char *Name, double *Result) {
+    LLVMOrcExecutorAddress Addr;
+    LLVMErrorRef Err = JITLookup(&Addr, Name);
+    if (Err) {
+        return ErrorLLVM(Err);
+    }
+    
+    // Cast it to the right type (takes no arguments, returns a double) so we
+    // can call it as a native function.
+    double (*FP)(void) = (double (*)(void)) (uintptr_t) Addr;
+    enum Phase Prev = EnterPhase(phase_execute);
+    *Result = FP();
+    EnterPhase(Prev);
+    return 1;
+}
+
+/// JITEvaluate - Compile and run a zero-argument function such as
+/// __anon_expr, removing its code from the JIT again afterwards.
+static int JITEvaluate(const struct FunctionAST *F, double *Result) {
+    InitializeModule();
+    if (!CodegenFunction(F, SymbolName(F->Proto->Name)) ||
+        !OptimizeModule(OptPipelines[Ctx->OptLevel])) {
+        LLVMDisposeModule(TheModule);
+        TheModule = NULL;
+        return 0;
+    }
+    
+    // Create a ResourceTracker to track JIT'd memory allocated to our
+    // anonymous expression -- that way we can free it after executing.
+    LLVMOrcResourceTrackerRef RT =
+        LLVMOrcJITDylibCreateResourceTracker(Ctx->MainJD);
+    int Ok = AddModule(RT) && JITRun(SymbolName(F->Proto->Name), Result);
+    
+    // Delete the anonymous expression module from the JIT.
+    return RemoveTracker(RT) && Ok;
+}
+
+#pragma mark Compile cache
+
+/// Each definition the JIT compiles outside batch mode can also be written to
+/// CacheDir (set by --cache-dir) as an object file, named after the function
+/// and a hash of its parsed source, the -O level and the target.  When the
+/// same definition is seen again, say when a library of defs is reloaded at
+/// startup, the object file is loaded straight into the JIT instead.
+#define CACHE_FORMAT "silly-cache-3"
+
+static uint64_t HashBytes(uint64_t Hash, const void *Data, size_t Len) {
+    const unsigned char *P = (const unsigned char *) Data;
+    for (size_t i = 0; i < Len; i++) {
+        Hash = (Hash ^ P[i]) * 1099511628211ull; // FNV-1a
+    }
+    return Hash;
+}
+
+static uint64_t HashString(uint64_t Hash, const char *Str) {
+    size_t Len = strlen(Str);
+    Hash = HashBytes(Hash, &Len, sizeof(Len));
+    return HashBytes(Hash, Str, Len);
+}
+
+static uint64_t HashInt(uint64_t Hash, int Val) {
+    return HashBytes(Hash, &Val, sizeof(Val));
+}
+
+/// HashExpr - Hash E as written: its shape, literals and the spelling of the
+/// names it uses, which is everything its compiled code depends on.
+static uint64_t HashExpr(uint64_t Hash, const struct ExprAST *E) {
+    Hash = HashInt(Hash, E->Kind);
+    Hash = HashInt(Hash, E->Type);
+    switch (E->Kind) {
+        case expr_number: {
+            double Val = ((const struct NumberExprAST *) E)->Val;
+            return HashBytes(Hash, &Val, sizeof(Val));
+        }
+        case expr_variable:
+            return HashInt(Hash, ((const struct VariableExprAST *) E)->Slot);
+        case expr_binary: {
+            const struct BinaryExprAST *B = (const struct BinaryExprAST *) E;
+            Hash = HashInt(Hash, B->Op);
+            Hash = HashExpr(Hash, B->LHS);
+            return HashExpr(Hash, B->RHS);
+        }
+        case expr_cast:
+            return HashExpr(Hash, ((const struct CastExprAST *) E)->Operand);
+        case expr_call: {
+            const struct CallExprAST *C = (const struct CallExprAST *) E;
+            Hash = HashString(Hash, SymbolName(C->Callee));
+            Hash = HashString(Hash, C->Sig ? SymbolName(C->Sig) : "");
+            Hash = HashInt(Hash, C->NumArgs);
+            for (int i = 0; i < C->NumArgs; i++) {
+                Hash = HashExpr(Hash, C->Args[i]);
+            }
+            return Hash;
+        }
+        case expr_if: {
+            const struct IfExprAST *If = (const struct IfExprAST *) E;
+            Hash = HashExpr(Hash, If->Cond);
+            Hash = HashExpr(Hash, If->Then);
+            return HashExpr(Hash, If->Else);
+        }
+        case expr_for: {
+            const struct ForExprAST *For = (const struct ForExprAST *) E;
+            Hash = HashString(Hash, SymbolName(For->VarName));
+            Hash = HashInt(Hash, For->VarType);
+            Hash = HashInt(Hash, For->Slot);
+            Hash = HashExpr(Hash, For->Start);
+            Hash = HashExpr(Hash, For->End);
+            Hash = HashInt(Hash, For->Step != NULL);
+            if (For->Step) {
+                Hash = HashExpr(Hash, For->Step);
+            }
+            return HashExpr(Hash, For->Body);
+        }
+    }
+    return Hash;
+}
+
+static uint64_t HashFunction(const struct FunctionAST *F) {
+    uint64_t Hash = HashInt(Ctx->CacheKeySeed, Ctx->OptLevel);
+    Hash = HashString(Hash, SymbolName(F->Proto->Name));
+    Hash = HashString(Hash, F->Proto->Sig ? SymbolName(F->Proto->Sig) : "");
+    Hash = HashInt(Hash, F->Proto->NumArgs);
+    for (int i = 0; i < F->Proto->NumArgs; i++) {
+        Hash = HashString(Hash, SymbolName(F->Proto->Args[i]));
+    }
+    return HashExpr(Hash, F->Body);
+}
+
+/// InitCompileCache - Set up HashFunction, which redefinition uses to spot
+/// unchanged bodies even without a cache, and create CacheDir if there is one.
+static int InitCompileCache() {
+    if (Ctx->CacheDir && mkdir(Ctx->CacheDir, 0777) && errno != EEXIST) {
+        fprintf(stderr, "Error: could not create cache directory %s\n",
+                Ctx->CacheDir);
+        return 0;
+    }
+    
+    char *CPU = LLVMGetHostCPUName();
+    char *Features = LLVMGetHostCPUFeatures();
+    uint64_t Hash = HashString(14695981039346656037ull, CACHE_FORMAT);
+    Hash = HashString(Hash, Ctx->JITTriple);
+    Hash = HashString(Hash, Ctx->JITDataLayout);
+    Hash = HashString(Hash, CPU);
+    Ctx->CacheKeySeed = HashString(Hash, Features);
+    LLVMDisposeMessage(CPU);
+    LLVMDisposeMessage(Features);
+    return 1;
+}
+
+/// WriteCacheFile - Store Obj at Path, going through a temporary file so that
+/// a concurrent reader never sees a partial object.
+static void WriteCacheFile(const char *Path, LLVMMemoryBufferRef Obj) {
+    char TmpPath[4096 + 32];
+    snprintf(TmpPath, sizeof(TmpPath), "%s.%ld.tmp", Path, (long) getpid());
+    FILE *Out = fopen(TmpPath, "wb");
+    size_t Size = LLVMGetBufferSize(Obj);
+    int Ok = Out && fwrite(LLVMGetBufferStart(Obj), 1, Size, Out) == Size;
+    if (Out && fclose(Out)) {
+        Ok = 0;
+    }
+    if (!Ok || rename(TmpPath, Path)) {
+        remove(TmpPath);
+        fprintf(stderr, "Error: could not write cache file %s\n", Path);
+    }
+}
+
+/// JITFunctionCached - Add definition F, compiled as Name, to the JIT from the
+/// cache, tracked by RT.  It is compiled to an object file and cached first if
+/// it is not there yet.  Name must be unique to F's HashFunction.
+static int JITFunctionCached(const struct FunctionAST *F, const char *Name,
+                             LLVMOrcResourceTrackerRef RT) {
+    char Path[4096];
+    snprintf(Path, sizeof(Path), "%s/%s.o", Ctx->CacheDir, Name);
+    
+    LLVMMemoryBufferRef Obj;
+    char *ErrMsg;
+    if (LLVMCreateMemoryBufferWithContentsOfFile(Path, &Obj, &ErrMsg)) {
+        LLVMDisposeMessage(ErrMsg);
+        
+        InitializeModule();
+        int Ok = CodegenFunction(F, Name) &&
+                 OptimizeModule(OptPipelines[Ctx->OptLevel]);
+        enum Phase Prev = EnterPhase(phase_jit);
+        if (Ok && LLVMTargetMachineEmitToMemoryBuffer(TheTargetMachine, TheModule,
+                                                      LLVMObjectFile, &ErrMsg,
+                                                      &Obj)) {
+            Ok = 0;
+            fprintf(stderr, "Error: %s\n", ErrMsg);
+            LLVMDisposeMessage(ErrMsg);
+        }
+        EnterPhase(Prev);
+        LLVMDisposeModule(TheModule);
+        TheModule = NULL;
+        if (!Ok) {
+            return 0;
+        }
+        WriteCacheFile(Path, Obj);
+    }
+    
+    LLVMErrorRef Err = LLVMOrcLLJITAddObjectFileWithRT(Ctx->TheJIT, RT, Obj);
+    return Err ? ErrorLLVM(Err) : 1;
+}
+
+#pragma mark Incremental redefinition
+
+/// Outside batch mode each JIT'd def is compiled on its own, as the symbol
+/// NAME.HASH where HASH is its HashFunction, and with a resource tracker of
+/// its own.  Everything else calls it through the NAME.slot pointer rather
+/// than by symbol.  Redefining a function then only compiles the new body:
+/// the slot is pointed at the new code and the old code is removed, however
+/// many callers there are.  A body that did not change is not compiled at all.
+
+/// JITDefinition - Compile F, whose HashFunction is Hash, and make it the code
+/// Entry's slot points at.  On error the previous code is left in place.
+static int JITDefinition(struct FunctionEntry *Entry,
+                         const struct FunctionAST *F, uint64_t Hash) {
+    const char *FnName = SymbolName(F->Proto->Name);
+    char Name[strlen(FnName) + 32];
+    sprintf(Name, "%s.%016llx", FnName, (unsigned long long) Hash);
+    
+    LLVMOrcResourceTrackerRef RT =
+        LLVMOrcJITDylibCreateResourceTracker(Ctx->MainJD);
+    int Ok = Ctx->CacheDir ? JITFunctionCached(F, Name, RT)
+                      : JITFunction(F, Name, RT);
+    LLVMOrcExecutorAddress Addr = 0;
+    LLVMErrorRef Err = Ok ? JITLookup(&Addr, Name) : NULL;
+    if (Err) {
+        Ok = ErrorLLVM(Err);
+    }
+    
+    // The slot is defined along with the first code it points at.
+    if (Ok && !Entry->Tracker) {
+        char SlotName[strlen(FnName) + sizeof(".slot")];
+        sprintf(SlotName, "%s.slot", FnName);
+        Ok = DefineAbsoluteSymbol(SlotName, &Entry->Address,
+                                  LLVMJITSymbolGenericFlagsExported);
+    }
+    if (!Ok) {
+        RemoveTracker(RT);
+        return 0;
+    }
+    
+    Entry->Address = (void *) (uintptr_t) Addr;
+    if (Entry->Tracker) {
+        RemoveTracker(Entry->Tracker);
+    }
+    Entry->Tracker = RT;
+    return 1;
+}
+
+/// A def that has a callee's body inlined into it keeps that body when the
+/// callee is redefined, so RefreshInlined then rebuilds it, from its Source,
+/// for whichever back end is in use.  Under the JIT only the rebuilt def is
+/// recompiled, as for any other redefinition.
+
+/// RefreshEntry - Rebuild Entry if any def it inlined has changed since,
+/// after rebuilding those first.  Returns 0 if recompiling it failed, which
+/// leaves the previous version in place.
+static int RefreshEntry(struct FunctionEntry *Entry) {
+    if (!Entry->Def || Entry->RefreshPass == Ctx->RefreshPass) {
+        return 1;
+    }
+    Entry->RefreshPass = Ctx->RefreshPass;
+    int Ok = 1, Stale = 0;
+    for (int i = 0; i < Entry->NumInlineDeps; i++) {
+        struct FunctionEntry *Dep = FindFunctionEntry(Entry->InlineDeps[i].Name);
+        Ok &= RefreshEntry(Dep);
+        Stale |= Dep->DefStamp != Entry->InlineDeps[i].Stamp;
+    }
+    if (!Stale) {
+        return Ok;
+    }
+    
+    struct Arena Arena = { NULL, NULL, NULL };
+    struct Arena *PrevArena = Ctx->CurArena;
+    Ctx->CurArena = &Arena;
+    struct InlineDep *Deps;
+    int NumDeps;
+    struct FunctionAST *F = InlineFunction(Entry->Source, &Deps, &NumDeps);
+    struct InlineInfo *Inline = AnalyzeFunction(F);
+    struct Bytecode *Code = NULL;
+    struct FlatExpr *Flat = NULL;
+    uint64_t Hash = Entry->Hash;
+    if (Ctx->Backend == silly_backend_vm) {
+        Ok = (Code = CompileFunction(F)) != NULL;
+    } else if (Ctx->FlatAST) {
+        Flat = FlattenFunction(F);
+    } else if (Ctx->Backend == silly_backend_jit) {
+        Hash = HashFunction(F);
+        Ok = Hash == Entry->Hash || JITDefinition(Entry, F, Hash);
+    }
+    Ctx->CurArena = PrevArena;
+    if (!Ok) {
+        ArenaFree(&Arena);
+        return 0;
+    }
+    
+    ArenaFree(&Entry->InlineArena);
+    Entry->InlineArena = Arena;
+    Entry->Def = F;
+    Entry->Code = Code;
+    Entry->Flat = Flat;
+    Entry->Hash = Hash;
+    Entry->Inline = Inline;
+    Entry->InlineDeps = Deps;
+    Entry->NumInlineDeps = NumDeps;
+    Entry->DefStamp = ++Ctx->DefGeneration;
+    return Ok;
+}
+
+/// RefreshInlined - Rebuild every def that has an outdated body inlined.
+static void RefreshInlined() {
+    Ctx->RefreshPass++;
+    for (int i = 0; i < MAX_SYMBOL_PAGES; i++) {
+        struct FunctionEntry *Page = Ctx->FunctionPages[i];
+        for (int j = 0; Page && j < SYMBOL_PAGE_SIZE; j++) {
+            RefreshEntry(&Page[j]);
+        }
+    }
+}
+
+#pragma mark Parallel compilation
+
+/// In batch mode with -j, the parsing thread only checks each function and
+/// queues it; NumJobs worker threads take functions off the queue and
+/// generate and optimize code for them, each into a module in its own
+/// LLVMContext.  Once the input is exhausted the workers' modules are
+/// round-tripped through bitcode into TheContext and linked into TheModule.
+
+struct CompileWorker {
+    pthread_t Thread;
+    struct silly_context *Context;
+    LLVMMemoryBufferRef Bitcode; // The worker's module, once it has finished.
+};
+
+/// CheckCallees - Report the errors codegen would for E's calls, so that a
+/// function is known to compile before it is queued.
+static int CheckCallees(const struct ExprAST *E) {
+    switch (E->Kind) {
+        case expr_number:
+        case expr_variable:
+            return 1;
+        case expr_binary: {
+            const struct BinaryExprAST *B = (const struct BinaryExprAST *) E;
+            return CheckCallees(B->LHS) && CheckCallees(B->RHS);
+        }
+        case expr_cast:
+            return CheckCallees(((const struct CastExprAST *) E)->Operand);
+        case expr_call: {
+            const struct CallExprAST *C = (const struct CallExprAST *) E;
+            const struct FunctionEntry *Entry = FindFunctionEntry(C->Callee);
+            if (!Entry || !Entry->Proto) {
+                Error("Unknown function referenced");
+                return 0;
+            }
+            if (Entry->Proto->NumArgs != C->NumArgs) {
+                Error("Incorrect # arguments passed");
+                return 0;
+            }
+            if (Entry->Proto->Sig != C->Sig) {
+                Error("Incorrect argument types passed");
+                return 0;
+            }
+            for (int i = 0; i < C->NumArgs; i++) {
+                if (!CheckCallees(C->Args[i])) {
+                    return 0;
+                }
+            }
+            return 1;
+        }
+        case expr_if: {
+            const struct IfExprAST *If = (const struct IfExprAST *) E;
+            return CheckCallees(If->Cond) && CheckCallees(If->Then) &&
+                   CheckCallees(If->Else);
+        }
+        case expr_for: {
+            const struct ForExprAST *For = (const struct ForExprAST *) E;
+            return CheckCallees(For->Start) && CheckCallees(For->End) &&
+                   (!For->Step || CheckCallees(For->Step)) &&
+                   CheckCallees(For->Body);
+        }
+    }
+    return 0;
+}
+
+static void PushWork(const struct FunctionAST *F) {
+    pthread_mutex_lock(&Ctx->WorkLock);
+    if (Ctx->WorkTail == Ctx->WorkCapacity) {
+        Ctx->WorkCapacity = Ctx->WorkCapacity ? Ctx->WorkCapacity * 2 : 1024;
+        Ctx->WorkQueue = (const struct FunctionAST **)
+            realloc(Ctx->WorkQueue, Ctx->WorkCapacity * sizeof(*Ctx->WorkQueue));
+    }
+    Ctx->WorkQueue[Ctx->WorkTail++] = F;
+    pthread_cond_signal(&Ctx->WorkAvailable);
+    pthread_mutex_unlock(&Ctx->WorkLock);
+}
+
+/// PopWork - Wait for the next queued function; NULL once the queue is
+/// closed and drained.
+static const struct FunctionAST *PopWork() {
+    pthread_mutex_lock(&Ctx->WorkLock);
+    while (Ctx->WorkHead == Ctx->WorkTail && !Ctx->WorkClosed) {
+        pthread_cond_wait(&Ctx->WorkAvailable, &Ctx->WorkLock);
+    }
+    const struct FunctionAST *F =
+        Ctx->WorkHead < Ctx->WorkTail ? Ctx->WorkQueue[Ctx->WorkHead++] : NULL;
+    pthread_mutex_unlock(&Ctx->WorkLock);
+    return F;
+}
+
+static void *CompileWorkerMain(void *Arg) {
+    struct CompileWorker *W = (struct CompileWorker *) Arg;
+    Ctx = W->Context;
+    IsCompileWorker = 1;
+    TheContext = LLVMContextCreate();
+    Builder = LLVMCreateBuilderInContext(TheContext);
+    DoubleTy = LLVMDoubleTypeInContext(TheContext);
+    TheTargetMachine = CreateHostTargetMachine(LLVMRelocDefault,
+                                               LLVMCodeModelJITDefault);
+    InitializeModule();
+    
+    // Errors are reported as they happen; a function that fails simply does
+    // not end up in the module.
+    const struct FunctionAST *F;
+    while ((F = PopWork())) {
+        CodegenFunction(F, SymbolName(F->Proto->Name));
+    }
+    OptimizeModule(OptPipelines[Ctx->OptLevel]);
+    W->Bitcode = LLVMWriteBitcodeToMemoryBuffer(TheModule);
+    
+    LLVMDisposeModule(TheModule);
+    LLVMDisposeBuilder(Builder);
+    if (TheTargetMachine) {
+        LLVMDisposeTargetMachine(TheTargetMachine);
+    }
+    LLVMContextDispose(TheContext);
+    return NULL;
+}
+
+static void StartCompileWorkers() {
+    Ctx->WorkHead = Ctx->WorkTail = 0;
+    Ctx->WorkClosed = 0;
+    Ctx->Workers = (struct CompileWorker *)
+        calloc(Ctx->NumJobs, sizeof(struct CompileWorker));
+    for (int i = 0; i < Ctx->NumJobs; i++) {
+        struct CompileWorker *W = &Ctx->Workers[i];
+        W->Context = Ctx;
+        pthread_create(&W->Thread, NULL, CompileWorkerMain, W);
+    }
+}
+
+/// FinishCompileWorkers - Let the workers drain the queue, then link their
+/// modules into TheModule.
+static int FinishCompileWorkers() {
+    pthread_mutex_lock(&Ctx->WorkLock);
+    Ctx->WorkClosed = 1;
+    pthread_cond_broadcast(&Ctx->WorkAvailable);
+    pthread_mutex_unlock(&Ctx->WorkLock);
+    
+    int Ok = 1;
+    for (int i = 0; i < Ctx->NumJobs; i++) {
+        pthread_join(Ctx->Workers[i].Thread, NULL);
+        
+        LLVMModuleRef M;
+        if (LLVMParseBitcodeInContext2(TheContext, Ctx->Workers[i].Bitcode, &M)) {
+            Ok = 0;
+            Error("could not read back a compiled module");
+        } else if (LLVMLinkModules2(TheModule, M)) {
+            Ok = 0;
+            Error("could not link a compiled module");
+        }
+        LLVMDisposeMemoryBuffer(Ctx->Workers[i].Bitcode);
+    }
+    free(Ctx->Workers);
+    Ctx->Workers = NULL;
+    return Ok;
+}
+
+/// CompileBatchFunction - Add F to the batch module, directly or through the
+/// worker queue.  Returns 0 if it has an error.
+static int CompileBatchFunction(const struct FunctionAST *F) {
+    if (!Ctx->UseCompileWorkers) {
+        return CodegenFunction(F, SymbolName(F->Proto->Name)) != NULL;
+    }
+    if (!CheckCallees(F->Body)) {
+        return 0;
+    }
+    PushWork(F);
+    return 1;
+}
+
+#pragma mark Parallel evaluation
+
+/// In batch mode with -j, top-level expressions that are pure are run on
+/// NumJobs threads at once once the batch is compiled, while the main thread
+/// runs the rest in source order; see RunBatch.  An expression is pure if
+/// it calls no extern, however indirectly, but those whose NativeFunction is
+/// Pure.  Kaleidoscope has no variables outside a function, so a pure
+/// expression's value cannot depend on when it runs, and the values are
+/// still reported in source order.
+
+static int IsPureExpr(const struct ExprAST *E);
+
+/// IsPureCall - Whether calling Entry is pure, as far as the current walk
+/// can tell.  A def already visited by it counts as pure: if it is not, the
+/// walk finds out on the way back to its first visit.
+static int IsPureCall(struct FunctionEntry *Entry) {
+    if (!Entry || Entry->Native) {
+        return Entry && Entry->Native->Pure;
+    } else if (!Entry->Def) {
+        return 0;
+    } else if (Entry->PureGeneration == Ctx->DefGeneration) {
+        return Entry->Pure;
+    } else if (Entry->PureWalk == Ctx->PureWalk) {
+        return 1;
+    }
+    
+    Entry->PureWalk = Ctx->PureWalk;
+    if (Ctx->NumPureVisited == Ctx->PureVisitedCapacity) {
+        Ctx->PureVisitedCapacity =
+            Ctx->PureVisitedCapacity ? Ctx->PureVisitedCapacity * 2 : 64;
+        Ctx->PureVisited = (struct FunctionEntry **) realloc(
+            Ctx->PureVisited,
+            Ctx->PureVisitedCapacity * sizeof(struct FunctionEntry *));
+    }
+    Ctx->PureVisited[Ctx->NumPureVisited++] = Entry;
+    if (!IsPureExpr(Entry->Def->Body)) {
+        // It reaches something impure, whatever else turns out.
+        Entry->Pure = 0;
+        Entry->PureGeneration = Ctx->DefGeneration;
+        return 0;
+    }
+    return 1;
+}
+
+static int IsPureExpr(const struct ExprAST *E) {
+    switch (E->Kind) {
+        case expr_number:
+        case expr_variable:
+            return 1;
+        case expr_binary: {
+            const struct BinaryExprAST *B = (const struct BinaryExprAST *) E;
+            return IsPureExpr(B->LHS) && IsPureExpr(B->RHS);
+        }
+        case expr_cast:
+            return IsPureExpr(((const struct CastExprAST *) E)->Operand);
+        case expr_call: {
+            const struct CallExprAST *C = (const struct CallExprAST *) E;
+            for (int i = 0; i < C->NumArgs; i++) {
+                if (!IsPureExpr(C->Args[i])) {
+                    return 0;
+                }
+            }
+            return IsPureCall(FindFunctionEntry(C->Callee));
+        }
+        case expr_if: {
+            const struct IfExprAST *If = (const struct IfExprAST *) E;
+            return IsPureExpr(If->Cond) && IsPureExpr(If->Then) &&
+                   IsPureExpr(If->Else);
+        }
+        case expr_for: {
+            const struct ForExprAST *For = (const struct ForExprAST *) E;
+            return IsPureExpr(For->Start) && IsPureExpr(For->End) &&
+                   (!For->Step || IsPureExpr(For->Step)) &&
+                   IsPureExpr(For->Body);
+        }
+    }
+    return 0;
+}
+
+/// IsPureFunction - Whether running F has no effect but its value.  The
+/// defs it reaches are remembered as pure or not until the next change to
+/// any function, so each is only walked once however many calls reach it.
+static int IsPureFunction(const struct FunctionAST *F) {
+    Ctx->PureWalk++;
+    Ctx->NumPureVisited = 0;
+    int Pure = IsPureExpr(F->Body);
+    if (Pure) {
+        // Everything the walk visited has been found to be pure as well.
+        for (int i = 0; i < Ctx->NumPureVisited; i++) {
+            Ctx->PureVisited[i]->Pure = 1;
+            Ctx->PureVisited[i]->PureGeneration = Ctx->DefGeneration;
+        }
+    }
+    return Pure;
+}
+
+/// BatchExpr - A compiled top-level expression for RunBatch, and its value
+/// once Done.
+struct BatchExpr {
+    double (*Fn)(void);
+    double Result;
+    int Done;
+};
+
+/// ExprPool - The pure expressions of a batch and the threads running them.
+/// They are handed out in source order from NextPure, to the main thread
+/// too whenever it is waiting for one, so the values it reports first are
+/// the first ones worked on.  Lock and ExprDone are for waiting on Done.
+struct ExprPool {
+    struct BatchExpr *Exprs;
+    int *Pure;             // Indices into Exprs.
+    int NumPure;
+    int NextPure;
+    pthread_t *Threads;
+    int NumThreads;
+    pthread_mutex_t Lock;
+    pthread_cond_t ExprDone;
+};
+
+/// RunNextPureExpr - Run the next pure expression no thread has taken yet.
+/// Returns 0 once they have all been taken.
+static int RunNextPureExpr(struct ExprPool *P) {
+    int i = __atomic_fetch_add(&P->NextPure, 1, __ATOMIC_RELAXED);
+    if (i >= P->NumPure) {
+        return 0;
+    }
+    struct BatchExpr *E = &P->Exprs[P->Pure[i]];
+    E->Result = E->Fn();
+    pthread_mutex_lock(&P->Lock);
+    __atomic_store_n(&E->Done, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&P->ExprDone);
+    pthread_mutex_unlock(&P->Lock);
+    return 1;
+}
+
+static void *ExprWorkerMain(void *Arg) {
+    struct ExprPool *P = (struct ExprPool *) Arg;
+    while (RunNextPureExpr(P)) {
+    }
+    return NULL;
+}
+
+/// StartExprPool - Start running the pure ones among the NumExprs at Exprs,
+/// as flagged in BatchExprPure, on NumJobs - 1 threads.
+static void StartExprPool(struct ExprPool *P, struct BatchExpr *Exprs,
+                          int NumExprs) {
+    memset(P, 0, sizeof(struct ExprPool));
+    P->Exprs = Exprs;
+    P->Pure = (int *) malloc(NumExprs * sizeof(int));
+    for (int i = 0; i < NumExprs; i++) {
+        if (Ctx->BatchExprPure[i]) {
+            P->Pure[P->NumPure++] = i;
+        }
+    }
+    pthread_mutex_init(&P->Lock, NULL);
+    pthread_cond_init(&P->ExprDone, NULL);
+    
+    // The main thread runs pure expressions too rather than just wait.
+    P->NumThreads = Ctx->NumJobs - 1 < P->NumPure - 1 ? Ctx->NumJobs - 1
+                                                      : P->NumPure - 1;
+    if (P->NumThreads > 0) {
+        P->Threads = (pthread_t *) malloc(P->NumThreads * sizeof(pthread_t));
+    }
+    for (int i = 0; i < P->NumThreads; i++) {
+        pthread_create(&P->Threads[i], NULL, ExprWorkerMain, P);
+    }
+}
+
+/// WaitForExpr - The value of the pure expression E, helping to run the
+/// pure ones not taken yet until it is done.
+static double WaitForExpr(struct ExprPool *P, struct BatchExpr *E) {
+    while (!__atomic_load_n(&E->Done, __ATOMIC_ACQUIRE) && RunNextPureExpr(P)) {
+    }
+    pthread_mutex_lock(&P->Lock);
+    while (!E->Done) {
+        pthread_cond_wait(&P->ExprDone, &P->Lock);
+    }
+    pthread_mutex_unlock(&P->Lock);
+    return E->Result;
+}
+
+/// FinishExprPool - Wait for the threads, which have run out of
+/// expressions, to exit.
+static void FinishExprPool(struct ExprPool *P) {
+    for (int i = 0; i < P->NumThreads; i++) {
+        pthread_join(P->Threads[i], NULL);
+    }
+    free(P->Threads);
+    free(P->Pure);
+    pthread_mutex_destroy(&P->Lock);
+    pthread_cond_destroy(&P->ExprDone);
+}
+
+#pragma mark Object file emission
+
+/// With --emit-obj or --emit-so the batch module is compiled ahead of time
+/// instead of being run: every def becomes a C-callable function of the same
+/// name, such as double fib(double), float scale(float, float) or int64_t
+/// tri(int64_t), in a position independent object file or shared library
+/// for the host.  Calls to externs are left for the linker to resolve.
+
+/// LinkSharedLibrary - Link the object file at ObjPath into the shared
+/// library Path with the system C compiler.
+static int LinkSharedLibrary(const char *ObjPath, const char *Path) {
+    extern char **environ;
+    char *const Argv[] = {
+        "cc", "-shared", "-o", (char *) Path, (char *) ObjPath, "-lm", NULL
+    };
+    pid_t Pid;
+    int Status;
+    if (posix_spawnp(&Pid, Argv[0], NULL, NULL, Argv, environ) ||
+        waitpid(Pid, &Status, 0) != Pid || !WIFEXITED(Status) ||
+        WEXITSTATUS(Status)) {
+        fprintf(stderr, "Error: could not link %s\n", Path);
+        return 0;
+    }
+    return 1;
+}
+
+/// EmitBatch - Optimize the module built up in batch mode and write it to
+/// EmitPath.  Nothing is written if the source had any errors, so that a
+/// library is never deployed with some of its functions missing.
+static int EmitBatch() {
+    if (Ctx->NumErrors != Ctx->FirstEmitError) {
+        fprintf(stderr, "Error: not writing %s after errors\n", Ctx->EmitPath);
+        return 0;
+    }
+    if (!OptimizeModule(BatchPipelines[Ctx->OptLevel])) {
+        return 0;
+    }
+    LLVMTargetMachineRef TM =
+        CreateHostTargetMachine(LLVMRelocPIC, LLVMCodeModelDefault);
+    if (!TM) {
+        return 0;
+    }
+    
+    char ObjPath[4096 + 32];
+    snprintf(ObjPath, sizeof(ObjPath), Ctx->EmitShared ? "%s.%ld.o" : "%s",
+             Ctx->EmitPath, (long) getpid());
+    enum Phase Prev = EnterPhase(phase_jit);
+    char *ErrMsg;
+    int Ok = !LLVMTargetMachineEmitToFile(TM, TheModule, ObjPath,
+                                          LLVMObjectFile, &ErrMsg);
+    EnterPhase(Prev);
+    LLVMDisposeTargetMachine(TM);
+    if (!Ok) {
+        fprintf(stderr, "Error: could not write %s: %s\n", ObjPath, ErrMsg);
+        LLVMDisposeMessage(ErrMsg);
+    } else if (Ctx->EmitShared) {
+        Ok = LinkSharedLibrary(ObjPath, Ctx->EmitPath);
+        remove(ObjPath);
+    }
+    return Ok;
+}
+
+#pragma mark Top-Level parsing
+
+/// PrintResult - Report the value of a top-level expression.
+static void PrintResult(double Result) {
+    if (Ctx->ResultOut) {
+        *Ctx->ResultOut = Result;
+    } else if (Ctx->OnResult) {
+        Ctx->OnResult(Ctx->ResultUser, Result);
+    } else if (Ctx->BatchMode) {
+        printf("%f\n", Result);
+    } else {
+        fprintf(stderr, "Evaluated to %f\n", Result);
+    }
+}
+
+/// SetBatchExprPure - Record whether the I'th expression of the current
+/// batch is pure.
+static void SetBatchExprPure(int I, int Pure) {
+    if (I >= Ctx->BatchExprCapacity) {
+        Ctx->BatchExprCapacity = 2 * I > 256 ? 2 * I : 256;
+        Ctx->BatchExprPure = (unsigned char *)
+            realloc(Ctx->BatchExprPure, Ctx->BatchExprCapacity);
+    }
+    Ctx->BatchExprPure[I] = (unsigned char) Pure;
+}
+
+/// DefineFunction - Check, compile and install the definition F parsed into
+/// DefArena, or drop it if it fails or is NULL.
+static void DefineFunction(struct FunctionAST *F) {
+    struct FunctionEntry *Entry = F ? GetFunctionEntry(F->Proto->Name) : NULL;
+    struct Bytecode *Code = NULL;
+    struct FlatExpr *Flat = NULL;
+    uint64_t Hash = 0;
+    int Unchanged = 0;
+    int Ok = F && ResolveFunction(F);
+    struct FunctionAST *Source = F;
+    struct InlineDep *Deps = NULL;
+    int NumDeps = 0;
+    struct InlineInfo *Inline = NULL;
+    if (Ok && Ctx->InlineThreshold > 0) {
+        F = InlineFunction(F, &Deps, &NumDeps);
+        Inline = AnalyzeFunction(F);
+    }
+    if (Ok && Ctx->Backend == silly_backend_vm) {
+        Ok = (Code = CompileFunction(F)) != NULL;
+    } else if (Ok && Ctx->FlatAST) {
+        Flat = FlattenFunction(F);
+    } else if (Ok && Ctx->Backend == silly_backend_jit && Entry->InJIT &&
+               (Ctx->BatchMode || Entry->Native)) {
+        Ok = 0;
+        Error("Function cannot be redefined with the JIT back end");
+    } else if (Ok && Ctx->Backend == silly_backend_jit && Entry->InJIT &&
+               Entry->Proto->NumArgs != F->Proto->NumArgs) {
+        // Existing callers were compiled for the old signature.
+        Ok = 0;
+        Error("Redefinition changes the number of arguments");
+    } else if (Ok && Ctx->Backend == silly_backend_jit && Entry->InJIT &&
+               Entry->Proto->Sig != F->Proto->Sig) {
+        Ok = 0;
+        Error("Redefinition changes the argument or result types");
+    } else if (Ok && Ctx->Backend == silly_backend_jit) {
+        // Record the prototype first so recursive calls can find it.
+        struct PrototypeAST *OldProto = Entry->Proto;
+        Entry->Proto = F->Proto;
+        if (Ctx->BatchMode) {
+            Ok = CompileBatchFunction(F);
+        } else {
+            Hash = HashFunction(F);
+            Unchanged = Entry->Tracker && Entry->Hash == Hash;
+            Ok = Unchanged || JITDefinition(Entry, F, Hash);
+        }
+        Entry->Proto = OldProto;
+    }
+    
+    if (Ok && Unchanged) {
+        // Keep the definition and code we already have.
+        ArenaFree(&Ctx->DefArena);
+        if (Ctx->Interactive) {
+            fprintf(stderr, "Function unchanged, still at version %d.\n",
+                    Entry->Version);
+        }
+    } else if (Ok) {
+        // The tier-up thread may be generating code from the old definition.
+        pthread_mutex_lock(&Ctx->DefLock);
+        int Redefined = Entry->Def != NULL;
+        ArenaFree(&Entry->Arena);
+        ArenaFree(&Entry->InlineArena);
+        Entry->Arena = Ctx->DefArena;
+        memset(&Ctx->DefArena, 0, sizeof(struct Arena));
+        Entry->Proto = F->Proto;
+        Entry->Def = F;
+        Entry->Native = NULL;
+        Entry->Code = Code;
+        Entry->Flat = Flat;
+        Entry->InJIT = Ctx->Backend == silly_backend_jit;
+        Entry->Hash = Hash;
+        Entry->Source = Source;
+        Entry->Inline = Inline;
+        Entry->InlineDeps = Deps;
+        Entry->NumInlineDeps = NumDeps;
+        Entry->DefStamp = ++Ctx->DefGeneration;
+        Entry->Version++;
+        if (Redefined) {
+            RefreshInlined();
+        }
+        pthread_mutex_unlock(&Ctx->DefLock);
+        if (Ctx->Interactive && Entry->Version == 1) {
+            fprintf(stderr, "Parsed a function definition.\n");
+        } else if (Ctx->Interactive) {
+            fprintf(stderr, "Redefined a function, now at version %d.\n",
+                    Entry->Version);
+        }
+    } else {
+        // Drop the partial definition.
+        ArenaFree(&Ctx->DefArena);
+    }
+    Ctx->CurArena = &Ctx->ItemArena;
+}
+
+static void HandleDefinition() {
+    Ctx->CurArena = &Ctx->DefArena;
+    enum Phase Prev = EnterPhase(phase_parse);
+    struct FunctionAST *F = ParseDefinition();
+    EnterPhase(Prev);
+    DefineFunction(F);
+    if (!F) {
+        // Skip token for error recovery.
+        Ctx->SkipToken = 1;
+    }
+}
+
+/// DeclareExtern - Bind the extern P, parsed into PersistentArena after
+/// Mark, to its native function, or drop it if it fails or is NULL.
+static void DeclareExtern(struct PrototypeAST *P, struct ArenaMark Mark) {
+    const struct NativeFunction *Native =
+        P && !P->Sig ? FindNativeFunction(P) : NULL;
+    struct FunctionEntry *Entry = Native ? GetFunctionEntry(P->Name) : NULL;
+    int Ok = Native != NULL;
+    if (Ok && Ctx->Backend == silly_backend_jit && Entry->InJIT) {
+        // Already defined, either by an earlier extern or by a def.
+        Ok = Entry->Native == Native;
+        if (!Ok) {
+            Error("Function cannot be redefined with the JIT back end");
+        }
+    } else if (Ok && Ctx->Backend == silly_backend_jit) {
+        Ok = DefineNativeSymbol(Native);
+    }
+    
+    if (Ok) {
+        pthread_mutex_lock(&Ctx->DefLock);
+        int Redefined = Entry->Def != NULL;
+        ArenaFree(&Entry->Arena); // Any definition this extern replaces.
+        ArenaFree(&Entry->InlineArena);
+        Entry->Proto = P;
+        Entry->Def = NULL;
+        Entry->Native = Native;
+        Entry->Code = NULL;
+        Entry->Flat = NULL;
+        Entry->InJIT = Ctx->Backend == silly_backend_jit;
+        Entry->Source = NULL;
+        Entry->Inline = NULL;
+        Entry->InlineDeps = NULL;
+        Entry->NumInlineDeps = 0;
+        Entry->DefStamp = ++Ctx->DefGeneration;
+        if (Redefined) {
+            RefreshInlined();
+        }
+        pthread_mutex_unlock(&Ctx->DefLock);
+        if (Ctx->Interactive) {
+            fprintf(stderr, "Parsed an extern\n");
+        }
+    } else {
+        // Say why the extern was refused, then drop the partial prototype.
+        if (P && P->Sig) {
+            Error("Externs must take and return f64");
+        } else if (P && !Native) {
+            Error("Unknown external function");
+        }
+        ArenaRelease(&Ctx->PersistentArena, Mark);
+    }
+    Ctx->CurArena = &Ctx->ItemArena;
+}
+
+static void HandleExtern() {
+    struct ArenaMark Mark = ArenaGetMark(&Ctx->PersistentArena);
+    Ctx->CurArena = &Ctx->PersistentArena;
+    enum Phase Prev = EnterPhase(phase_parse);
+    struct PrototypeAST *P = ParseExtern();
+    EnterPhase(Prev);
+    DeclareExtern(P, Mark);
+    if (!P) {
+        // Skip token for error recovery.
+        Ctx->SkipToken = 1;
+    }
+}
+
+/// EvaluateTopLevel - Run the top-level expression F, parsed into
+/// CurArena, and report its value.
+static void EvaluateTopLevel(struct FunctionAST *F) {
+    if (F) {
+        double Result;
+        int Ok = ResolveFunction(F);
+        // Run only once, it is only worth inlining into when it is compiled.
+        if (Ok && Ctx->InlineThreshold > 0 &&
+            Ctx->Backend == silly_backend_jit) {
+            struct InlineDep *Deps;
+            int NumDeps;
+            F = InlineFunction(F, &Deps, &NumDeps);
+        }
+        if (Ok && Ctx->EmitPath) {
+            Ok = 0;
+            Error("Top-level expressions cannot be compiled ahead of time");
+        } else if (Ok && Ctx->Backend == silly_backend_jit && Ctx->BatchMode) {
+            // Compile it now, run it once the whole module is built.
+            char Name[32];
+            int Len = snprintf(Name, sizeof(Name), "__anon_expr.%d",
+                               Ctx->NumBatchExprs);
+            F->Proto->Name = InternSymbol(Name, Len);
+            if (CompileBatchFunction(F)) {
+                if (Ctx->NumJobs > 1) {
+                    SetBatchExprPure(Ctx->NumBatchExprs - Ctx->FirstBatchExpr,
+                                     IsPureFunction(F));
+                }
+                Ctx->NumBatchExprs++;
+            }
+            Ok = 0;
+        } else if (Ok && Ctx->Backend == silly_backend_jit) {
+            Ok = JITEvaluate(F, &Result);
+        } else if (Ok && Ctx->Backend == silly_backend_vm) {
+            struct Bytecode *Code = CompileFunction(F);
+            enum Phase Prev = EnterPhase(phase_execute);
+            Ok = Code && RunFunction(Code, &Result);
+            EnterPhase(Prev);
+        } else if (Ok && Ctx->FlatAST) {
+            struct FlatExpr *Flat = FlattenFunction(F);
+            enum Phase Prev = EnterPhase(phase_execute);
+            Ok = EvalFlatFunction(Flat, &Result);
+            EnterPhase(Prev);
+        } else if (Ok) {
+            enum Phase Prev = EnterPhase(phase_execute);
+            Ok = EvalFunction(F, &Result);
+            EnterPhase(Prev);
+        }
+        if (Ok) {
+            PrintResult(Result);
+        }
+    }
+    
+    // Nothing parsed for the expression is needed any more.
+    Ctx->CurArena = &Ctx->ItemArena;
+    ArenaReset(&Ctx->ItemArena);
+}
+
+static void HandleTopLevelExpression() {
+    // Queued expressions are compiled after this item is done with.
+    if (Ctx->UseCompileWorkers) {
+        Ctx->CurArena = &Ctx->PersistentArena;
+    }
+    
+    // Evaluate a top-level expression into an anonymous function.
+    enum Phase Prev = EnterPhase(phase_parse);
+    struct FunctionAST *F = ParseTopLevelExpr();
+    EnterPhase(Prev);
+    EvaluateTopLevel(F);
+    if (!F) {
+        // Skip token for error recovery.
+        Ctx->SkipToken = 1;
+    }
+}
+
+/// RunBatch - Optimize and compile the module built up in batch mode, then
+/// run its top-level expressions and report their values in source order.
+/// With -j the pure ones run on an ExprPool, alongside the main thread
+/// running the others.
+static int RunBatch() {
+    if (!OptimizeModule(BatchPipelines[Ctx->OptLevel]) || !AddModule(NULL)) {
+        return 0;
+    }
+    
+    // Look them all up first.  If one is missing, those before it still run.
+    int NumExprs = Ctx->NumBatchExprs - Ctx->FirstBatchExpr;
+    struct BatchExpr *Exprs = (struct BatchExpr *)
+        calloc(NumExprs ? NumExprs : 1, sizeof(struct BatchExpr));
+    LLVMErrorRef Err = NULL;
+    for (int i = 0; i < NumExprs && !Err; i++) {
+        char Name[32];
+        snprintf(Name, sizeof(Name), "__anon_expr.%d", Ctx->FirstBatchExpr + i);
+        LLVMOrcExecutorAddress Addr;
+        if ((Err = JITLookup(&Addr, Name))) {
+            NumExprs = i;
+        } else {
+            Exprs[i].Fn = (double (*)(void)) (uintptr_t) Addr;
+        }
+    }
+    
+    enum Phase Prev = EnterPhase(phase_execute);
+    struct ExprPool Pool;
+    int UsePool = Ctx->NumJobs > 1 && NumExprs > 1;
+    if (UsePool) {
+        StartExprPool(&Pool, Exprs, NumExprs);
+    }
+    for (int i = 0; i < NumExprs; i++) {
+        double Result = UsePool && Ctx->BatchExprPure[i]
+                            ? WaitForExpr(&Pool, &Exprs[i])
+                            : Exprs[i].Fn();
+        PrintResult(Result);
+    }
+    if (UsePool) {
+        FinishExprPool(&Pool);
+    }
+    EnterPhase(Prev);
+    free(Exprs);
+    return Err ? ErrorLLVM(Err) : 1;
+}
+
+static void FreeRetiredTierCode();
+
+/// HandleItem - Handle one top-level item.  Returns 0 at end of input.
+/// top ::= definition | external | expression | ';'
+static int HandleItem() {
+    if (Ctx->TierThreshold) {
+        FreeRetiredTierCode();
+    }
+    if (Ctx->SkipToken) {
+        Ctx->SkipToken = 0;
+        getNextToken();
+    }
+    if (Ctx->Interactive) {
+        fprintf(stderr, "ready> ");
+    }
+    switch (Ctx->CurTok) {
+        case tok_eof:
+            return 0;
+        case ';': // ignore top-level semicolons.
+            getNextToken();
+            break;
+        case tok_def:
+            HandleDefinition();
+            break;
+        case tok_extern:
+            HandleExtern();
+            break;
+        default:
+            HandleTopLevelExpression();
+            break;
+    }
+    return 1;
+}
+
+static void MainLoop() {
+    while (HandleItem()) {
+    }
+}
+
+/// RunPushedItems - Handle every item the input pushed so far completes.
+/// Only parsing reads input, so an item that runs out of it has done nothing
+/// yet but allocate and intern symbols: the lexer state is put back to the
+/// start of the item and its allocations are dropped, and the item is parsed
+/// again from there once more input has been pushed.
+static void RunPushedItems() {
+    while (1) {
+        const char *Ptr = Ctx->CurPtr;
+        int Tok = Ctx->CurTok;
+        int Sym = Ctx->IdentifierSym;
+        double Num = Ctx->NumVal;
+        int Skip = Ctx->SkipToken;
+        struct ArenaMark Mark = ArenaGetMark(&Ctx->PersistentArena);
+        if (setjmp(Ctx->NeedInputJmp)) {
+            Ctx->CurPtr = Ptr;
+            Ctx->CurTok = Tok;
+            Ctx->IdentifierSym = Sym;
+            Ctx->NumVal = Num;
+            Ctx->SkipToken = Skip;
+            Ctx->NumArgStack = 0;
+            Ctx->CurArena = &Ctx->ItemArena;
+            ArenaReset(&Ctx->ItemArena);
+            ArenaFree(&Ctx->DefArena);
+            ArenaRelease(&Ctx->PersistentArena, Mark);
+            EnterPhase(phase_other);
+            return;
+        }
+        if (!HandleItem()) {
+            return;
+        }
+    }
+}
+
+#pragma mark Parallel front end
+
+/// silly_run_files runs several files as a single source.  Up to NumJobs
+/// parse workers take the files in order and lex and parse each into a list
+/// of items, every worker in a context of its own that shares the symbol
+/// table.  Meanwhile the calling thread handles each file's items, in source
+/// order, as soon as the file has been parsed, so the function table, and
+/// every check of a call against it, changes just as it would if the files
+/// were read one after another.
+
+/// ParsedItem - A def, extern or top-level expression parsed ahead of time,
+/// along with the range of its file's ErrorLog that parsing it reported.
+/// Def, or Proto for an extern, is NULL if it did not parse.  A def has an
+/// arena of its own, which becomes DefArena when it is handled.
+struct ParsedItem {
+    int Kind; // tok_def, tok_extern, or 0 for a top-level expression.
+    struct FunctionAST *Def;
+    struct PrototypeAST *Proto;
+    struct Arena Arena;
+    size_t ErrorStart, ErrorEnd;
+    int NumErrors;
+};
+
+/// ParsedFile - What a parse worker made of one file.  Everything but the
+/// defs is allocated in Arena, which lasts until the batch is over.
+struct ParsedFile {
+    const char *Path;
+    int Opened;
+    int Done; // The rest has been filled in.
+    struct ParsedItem *Items;
+    int NumItems, ItemCapacity;
+    struct Arena Arena;
+    char *ErrorLog;
+};
+
+static struct ParsedItem *AddParsedItem(struct ParsedFile *File) {
+    if (File->NumItems == File->ItemCapacity) {
+        File->ItemCapacity = File->ItemCapacity ? File->ItemCapacity * 2 : 256;
+        File->Items = (struct ParsedItem *) realloc(
+            File->Items, File->ItemCapacity * sizeof(struct ParsedItem));
+    }
+    struct ParsedItem *Item = &File->Items[File->NumItems++];
+    memset(Item, 0, sizeof(struct ParsedItem));
+    return Item;
+}
+
+/// ParseFile - Parse every item of File the way HandleItem would.
+static void ParseFile(struct ParsedFile *File) {
+    if (!(File->Opened = InitSourceFile(File->Path))) {
+        return;
+    }
+    Ctx->SkipToken = 0;
+    getNextToken();
+    while (1) {
+        if (Ctx->SkipToken) {
+            Ctx->SkipToken = 0;
+            getNextToken();
+        }
+        if (Ctx->CurTok == tok_eof) {
+            break;
+        } else if (Ctx->CurTok == ';') {
+            getNextToken();
+            continue;
+        }
+        
+        struct ParsedItem *Item = AddParsedItem(File);
+        int NumErrors = Ctx->NumErrors;
+        Item->ErrorStart = Ctx->ErrorLogLen;
+        if (Ctx->CurTok == tok_def) {
+            Item->Kind = tok_def;
+            Ctx->CurArena = &Item->Arena;
+            Item->Def = ParseDefinition();
+        } else if (Ctx->CurTok == tok_extern) {
+            Item->Kind = tok_extern;
+            Ctx->CurArena = &File->Arena;
+            Item->Proto = ParseExtern();
+        } else {
+            Ctx->CurArena = &File->Arena;
+            Item->Def = ParseTopLevelExpr();
+        }
+        Item->ErrorEnd = Ctx->ErrorLogLen;
+        Item->NumErrors = Ctx->NumErrors - NumErrors;
+        if (!Item->Def && !Item->Proto) {
+            // Skip token for error recovery.
+            ArenaFree(&Item->Arena);
+            Ctx->SkipToken = 1;
+        }
+    }
+    ReleaseSource();
+}
+
+static void *ParseWorkerMain(void *Arg) {
+    struct silly_context *Parent = (struct silly_context *) Arg;
+    struct silly_context *W =
+        (struct silly_context *) calloc(1, sizeof(struct silly_context));
+    W->Symbols = Parent->Symbols;
+    W->SymbolCache = (int *) calloc(SYMBOL_CACHE_SIZE, sizeof(int));
+    W->AnonExprSym = Parent->AnonExprSym;
+    memcpy(W->BinopPrecedence, Parent->BinopPrecedence,
+           sizeof(W->BinopPrecedence));
+    W->SourceFD = -1;
+    W->LogErrors = 1;
+    if (Parent->Stats) {
+        // Only the parser's allocations are of interest, not the timings.
+        W->Stats = (struct Stats *) calloc(1, sizeof(struct Stats));
+        W->Stats->CurPhase = phase_parse;
+    }
+    Ctx = W;
+    
+    int i;
+    while ((i = __atomic_fetch_add(&Parent->NextParsedFile, 1,
+                                   __ATOMIC_RELAXED)) < Parent->NumParsedFiles) {
+        struct ParsedFile *File = &Parent->ParsedFiles[i];
+        ParseFile(File);
+        File->ErrorLog = W->ErrorLog;
+        W->ErrorLog = NULL;
+        W->ErrorLogLen = W->ErrorLogCapacity = 0;
+        
+        pthread_mutex_lock(&Parent->ParseLock);
+        File->Done = 1;
+        pthread_cond_broadcast(&Parent->FileParsed);
+        pthread_mutex_unlock(&Parent->ParseLock);
+    }
+    
+    if (W->Stats) {
+        struct Stats *S = Parent->Stats;
+        for (int i = 0; i < NUM_EXPR_KINDS; i++) {
+            __atomic_add_fetch(&S->NodeCounts[i], W->Stats->NodeCounts[i],
+                               __ATOMIC_RELAXED);
+        }
+        __atomic_add_fetch(&S->NumAllocs, W->Stats->NumAllocs, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&S->BytesAllocated, W->Stats->BytesAllocated,
+                           __ATOMIC_RELAXED);
+        free(W->Stats);
+    }
+    free(W->SymbolCache);
+    free(W->ArgStack);
+    free(W->ParamBuf);
+    free(W->ParamTypeBuf);
+    free(W);
+    return NULL;
+}
+
+/// StartParseWorkers - Start parsing the files at Paths, on as many
+/// workers as there are jobs or files, whichever is fewer.
+static void StartParseWorkers(const char *const *Paths, int NumFiles) {
+    Ctx->ParsedFiles = (struct ParsedFile *)
+        calloc(NumFiles, sizeof(struct ParsedFile));
+    for (int i = 0; i < NumFiles; i++) {
+        Ctx->ParsedFiles[i].Path = Paths[i];
+    }
+    Ctx->NumParsedFiles = NumFiles;
+    Ctx->NextParsedFile = 0;
+    Ctx->Symbols->Shared = 1;
+    
+    Ctx->NumParseWorkers = Ctx->NumJobs < NumFiles ? Ctx->NumJobs : NumFiles;
+    Ctx->ParseWorkers = (pthread_t *)
+        malloc(Ctx->NumParseWorkers * sizeof(pthread_t));
+    for (int i = 0; i < Ctx->NumParseWorkers; i++) {
+        pthread_create(&Ctx->ParseWorkers[i], NULL, ParseWorkerMain, Ctx);
+    }
+}
+
+/// CopyPrototype - A copy of P in CurArena.
+static struct PrototypeAST *CopyPrototype(const struct PrototypeAST *P) {
+    ALLOC_STRUCT_ARGS(Result, PrototypeAST, P->NumArgs);
+    memcpy(Result, P, sizeof(struct PrototypeAST) + P->NumArgs * sizeof(int));
+    if (P->ArgTypes) {
+        Result->ArgTypes = (unsigned char *) ArenaAlloc(Ctx->CurArena,
+                                                        P->NumArgs);
+        memcpy(Result->ArgTypes, P->ArgTypes, P->NumArgs);
+    }
+    return Result;
+}
+
+/// HandleParsedItem - Print the errors parsing Item reported, then handle
+/// it as HandleItem would have.
+static void HandleParsedItem(struct ParsedFile *File, struct ParsedItem *Item) {
+    if (Ctx->TierThreshold) {
+        FreeRetiredTierCode();
+    }
+    if (Item->NumErrors) {
+        fwrite(File->ErrorLog + Item->ErrorStart, 1,
+               Item->ErrorEnd - Item->ErrorStart, stderr);
+        __atomic_add_fetch(&Ctx->NumErrors, Item->NumErrors, __ATOMIC_RELAXED);
+    }
+    if (Item->Kind == tok_def) {
+        Ctx->DefArena = Item->Arena;
+        memset(&Item->Arena, 0, sizeof(struct Arena));
+        Ctx->CurArena = &Ctx->DefArena;
+        DefineFunction(Item->Def);
+    } else if (Item->Kind == tok_extern) {
+        // Unlike the file, a declaration lasts as long as the context.
+        struct ArenaMark Mark = ArenaGetMark(&Ctx->PersistentArena);
+        Ctx->CurArena = &Ctx->PersistentArena;
+        DeclareExtern(Item->Proto ? CopyPrototype(Item->Proto) : NULL, Mark);
+    } else {
+        Ctx->CurArena = &File->Arena;
+        EvaluateTopLevel(Item->Def);
+    }
+}
+
+/// HandleParsedFile - Wait for File to be parsed, then handle its items.
+/// Returns 0 if it could not be opened.
+static int HandleParsedFile(struct ParsedFile *File) {
+    enum Phase Prev = EnterPhase(phase_parse);
+    pthread_mutex_lock(&Ctx->ParseLock);
+    while (!File->Done) {
+        pthread_cond_wait(&Ctx->FileParsed, &Ctx->ParseLock);
+    }
+    pthread_mutex_unlock(&Ctx->ParseLock);
+    EnterPhase(Prev);
+    
+    if (!File->Opened) {
+        // Counted, so that a batch with a file missing is not emitted.
+        fprintf(stderr, "Error: could not open %s\n", File->Path);
+        __atomic_add_fetch(&Ctx->NumErrors, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    for (int i = 0; i < File->NumItems; i++) {
+        HandleParsedItem(File, &File->Items[i]);
+    }
+    
+    // Only queued expressions still need what was parsed.
+    if (!Ctx->UseCompileWorkers) {
+        ArenaFree(&File->Arena);
+    }
+    return 1;
+}
+
+/// FinishParseWorkers - Wait for the workers, which have run out of files,
+/// to exit.
+static void FinishParseWorkers() {
+    for (int i = 0; i < Ctx->NumParseWorkers; i++) {
+        pthread_join(Ctx->ParseWorkers[i], NULL);
+    }
+    free(Ctx->ParseWorkers);
+    Ctx->ParseWorkers = NULL;
+    Ctx->NumParseWorkers = 0;
+    Ctx->Symbols->Shared = 0;
+}
+
+/// FreeParsedFiles - Free what is left of the parsed files once nothing
+/// refers to it any more.
+static void FreeParsedFiles() {
+    for (int i = 0; i < Ctx->NumParsedFiles; i++) {
+        struct ParsedFile *File = &Ctx->ParsedFiles[i];
+        for (int j = 0; j < File->NumItems; j++) {
+            ArenaFree(&File->Items[j].Arena);
+        }
+        ArenaFree(&File->Arena);
+        free(File->Items);
+        free(File->ErrorLog);
+    }
+    free(Ctx->ParsedFiles);
+    Ctx->ParsedFiles = NULL;
+    Ctx->NumParsedFiles = 0;
+}
+
+#pragma mark Batch evaluation
+
+/// silly_eval_batch applies one function to many argument tuples.  Under the
+/// JIT the function is compiled into a loop over the argument columns, with
+/// everything it calls inlined, so that LLVM's loop vectorizer can turn it
+/// into SIMD code for the host CPU.  The other back ends simply call the
+/// function once per tuple.
+
+/// CodegenCallees - Emit the definition of every function E calls, directly
+/// or indirectly, into TheModule as internal functions.
+static int CodegenCallees(const struct ExprAST *E) {
+    switch (E->Kind) {
+        case expr_number:
+        case expr_variable:
+            return 1;
+        case expr_binary: {
+            const struct BinaryExprAST *B = (const struct BinaryExprAST *) E;
+            return CodegenCallees(B->LHS) && CodegenCallees(B->RHS);
+        }
+        case expr_cast:
+            return CodegenCallees(((const struct CastExprAST *) E)->Operand);
+        case expr_call: {
+            const struct CallExprAST *C = (const struct CallExprAST *) E;
+            const struct FunctionEntry *Entry = FindFunctionEntry(C->Callee);
+            const char *Name = SymbolName(C->Callee);
+            LLVMValueRef F = LLVMGetNamedFunction(TheModule, Name);
+            if (Entry && Entry->Def && (!F || LLVMIsDeclaration(F))) {
+                if (!(F = CodegenFunction(Entry->Def, Name))) {
+                    return 0;
+                }
+                LLVMSetLinkage(F, LLVMInternalLinkage);
+                if (!CodegenCallees(Entry->Def->Body)) {
+                    return 0;
+                }
+            }
+            for (int i = 0; i < C->NumArgs; i++) {
+                if (!CodegenCallees(C->Args[i])) {
+                    return 0;
+                }
+            }
+            return 1;
+        }
+        case expr_if: {
+            const struct IfExprAST *If = (const struct IfExprAST *) E;
+            return CodegenCallees(If->Cond) && CodegenCallees(If->Then) &&
+                   CodegenCallees(If->Else);
+        }
+        case expr_for: {
+            const struct ForExprAST *For = (const struct ForExprAST *) E;
+            return CodegenCallees(For->Start) && CodegenCallees(For->End) &&
+                   (!For->Step || CodegenCallees(For->Step)) &&
+                   CodegenCallees(For->Body);
+        }
+    }
+    return 0;
+}
+
+/// CodegenKernel - Emit Entry's function, called Name, followed by
+///
+///   void NAME.batch(const double **Args, double *Out, size_t N)
+///
+/// which sets Out[i] = NAME(Args[0][i], Args[1][i], ...) for i < N,
+/// converting the columns to the types of NAME's arguments and back.
+static LLVMValueRef CodegenKernel(const struct FunctionEntry *Entry,
+                                  const char *Name, const char *KernelName) {
+    LLVMValueRef Fn = Entry->Def ? CodegenFunction(Entry->Def, Name)
+                                 : CodegenProto(Entry->Proto, Name);
+    if (!Fn || (Entry->Def && !CodegenCallees(Entry->Def->Body))) {
+        return NULL;
+    }
+    if (Entry->Def) {
+        LLVMSetLinkage(Fn, LLVMInternalLinkage);
+    }
+    
+    LLVMTypeRef SizeTy = LLVMIntTypeInContext(TheContext, 8 * sizeof(size_t));
+    LLVMTypeRef DoublePtrTy = LLVMPointerType(DoubleTy, 0);
+    LLVMTypeRef Params[3] = {
+        LLVMPointerType(DoublePtrTy, 0), DoublePtrTy, SizeTy
+    };
+    LLVMValueRef Kernel = LLVMAddFunction(TheModule, KernelName,
+        LLVMFunctionType(LLVMVoidTypeInContext(TheContext), Params, 3, 0));
+    LLVMValueRef Args = LLVMGetParam(Kernel, 0);
+    LLVMValueRef Out = LLVMGetParam(Kernel, 1);
+    LLVMValueRef N = LLVMGetParam(Kernel, 2);
+    
+    LLVMBasicBlockRef EntryBB =
+        LLVMAppendBasicBlockInContext(TheContext, Kernel, "entry");
+    LLVMBasicBlockRef LoopBB =
+        LLVMAppendBasicBlockInContext(TheContext, Kernel, "loop");
+    LLVMBasicBlockRef ExitBB =
+        LLVMAppendBasicBlockInContext(TheContext, Kernel, "exit");
+    
+    // Load the column pointers once, ahead of the loop.
+    int NumArgs = Entry->Proto->NumArgs;
+    LLVMValueRef Columns[NumArgs + 1];
+    LLVMPositionBuilderAtEnd(Builder, EntryBB);
+    for (int i = 0; i < NumArgs; i++) {
+        LLVMValueRef Index = LLVMConstInt(SizeTy, i, 0);
+        LLVMValueRef Ptr = LLVMBuildGEP2(Builder, DoublePtrTy, Args, &Index, 1,
+                                         "colptr");
+        Columns[i] = LLVMBuildLoad2(Builder, DoublePtrTy, Ptr, "col");
+    }
+    LLVMValueRef Zero = LLVMConstInt(SizeTy, 0, 0);
+    LLVMBuildCondBr(Builder, LLVMBuildICmp(Builder, LLVMIntEQ, N, Zero, "empty"),
+                    ExitBB, LoopBB);
+    
+    LLVMPositionBuilderAtEnd(Builder, LoopBB);
+    LLVMValueRef I = LLVMBuildPhi(Builder, SizeTy, "i");
+    LLVMValueRef ArgsV[NumArgs + 1];
+    for (int i = 0; i < NumArgs; i++) {
+        LLVMValueRef Ptr = LLVMBuildGEP2(Builder, DoubleTy, Columns[i], &I, 1,
+                                         "argptr");
+        ArgsV[i] = BuildConvert(LLVMBuildLoad2(Builder, DoubleTy, Ptr, "arg"),
+                                type_f64, ArgType(Entry->Proto, i));
+    }
+    LLVMValueRef Result = LLVMBuildCall2(Builder, LLVMGlobalGetValueType(Fn),
+                                         Fn, ArgsV, NumArgs, "result");
+    Result = BuildConvert(Result, Entry->Proto->RetType, type_f64);
+    LLVMBuildStore(Builder, Result,
+                   LLVMBuildGEP2(Builder, DoubleTy, Out, &I, 1, "outptr"));
+    LLVMValueRef Next = LLVMBuildAdd(Builder, I, LLVMConstInt(SizeTy, 1, 0),
+                                     "next");
+    LLVMBuildCondBr(Builder, LLVMBuildICmp(Builder, LLVMIntEQ, Next, N, "done"),
+                    ExitBB, LoopBB);
+    LLVMValueRef Incoming[2] = { Zero, Next };
+    LLVMBasicBlockRef IncomingBB[2] = { EntryBB, LoopBB };
+    LLVMAddIncoming(I, Incoming, IncomingBB, 2);
+    
+    LLVMPositionBuilderAtEnd(Builder, ExitBB);
+    LLVMBuildRetVoid(Builder);
+    
+    if (LLVMVerifyFunction(Kernel, LLVMPrintMessageAction)) {
+        return NULL;
+    }
+    return Kernel;
+}
+
+/// GetKernel - Entry's batch kernel, compiling it first if it is missing or
+/// stale.  Returns 0 on error.
+static int GetKernel(struct FunctionEntry *Entry, const char *Name) {
+    if (Entry->Kernel && Entry->KernelGeneration == Ctx->DefGeneration) {
+        return 1;
+    }
+    if (Entry->KernelTracker) {
+        RemoveTracker(Entry->KernelTracker);
+        Entry->KernelTracker = NULL;
+        Entry->Kernel = NULL;
+    }
+    
+    char KernelName[strlen(Name) + sizeof(".batch")];
+    sprintf(KernelName, "%s.batch", Name);
+    
+    // Callees are emitted as direct calls, for inlining.
+    int SavedUseCallSlots = Ctx->UseCallSlots;
+    Ctx->UseCallSlots = 0;
+    InitializeModule();
+    int Ok = CodegenKernel(Entry, Name, KernelName) &&
+             OptimizeModule(BatchPipelines[Ctx->OptLevel]);
+    Ctx->UseCallSlots = SavedUseCallSlots;
+    if (!Ok) {
+        LLVMDisposeModule(TheModule);
+        TheModule = NULL;
+        return 0;
+    }
+    
+    LLVMOrcResourceTrackerRef RT =
+        LLVMOrcJITDylibCreateResourceTracker(Ctx->MainJD);
+    LLVMOrcExecutorAddress Addr;
+    LLVMErrorRef Err = NULL;
+    Ok = AddModule(RT) &&
+         !(Err = JITLookup(&Addr, KernelName));
+    if (!Ok) {
+        if (Err) {
+            ErrorLLVM(Err);
+        }
+        RemoveTracker(RT);
+        return 0;
+    }
+    
+    Entry->Kernel = (void (*)(const double **, double *, size_t)) (uintptr_t) Addr;
+    Entry->KernelGeneration = Ctx->DefGeneration;
+    Entry->KernelTracker = RT;
+    return 1;
+}
+
+/// EvalBatch - silly_eval_batch for the tree walker and the VM.
+static int EvalBatch(struct FunctionEntry *Entry, const double *args[],
+                     double *out, size_t n) {
+    int NumArgs = Entry->Proto->NumArgs;
+    int FrameSize = Entry->Def ? Entry->Def->NumSlots : NumArgs;
+    if (FrameSize > EVAL_STACK_SIZE) {
+        Error("Stack overflow");
+        return 0;
+    }
+    if (setjmp(Ctx->EvalErrorJmp)) {
+        return 0;
+    }
+    for (size_t i = 0; i < n; i++) {
+        for (int j = 0; j < NumArgs; j++) {
+            Ctx->EvalStack[j] = ConvertValue(args[j][i], type_f64,
+                                             ArgType(Entry->Proto, j));
+        }
+        Ctx->EvalDepth = 0;
+        double Result;
+        if (Entry->Native) {
+            Result = CallNative(Entry->Native, Ctx->EvalStack);
+        } else if (Ctx->Backend == silly_backend_vm) {
+            const struct TierCode *T;
+            if (Ctx->TierThreshold && (T = TieredCode(Entry))) {
+                Result = T->Fn(Ctx->EvalStack);
+            } else if (Entry->Code->NumRegs > EVAL_STACK_SIZE) {
+                EvalError("Stack overflow");
+            } else {
+                Result = RunBytecode(Entry->Code, Ctx->EvalStack);
+            }
+        } else if (Entry->Flat) {
+            Ctx->EvalSP = Ctx->EvalStack + FrameSize;
+            Result = EvalFlat(Entry->Flat, Ctx->EvalStack);
+        } else {
+            Ctx->EvalSP = Ctx->EvalStack + FrameSize;
+            Result = EvalExpr(Entry->Def->Body, Ctx->EvalStack);
+        }
+        out[i] = ConvertValue(Result, Entry->Proto->RetType, type_f64);
+    }
+    return 1;
+}
+
+#pragma mark Tiered execution
+
+/// With --tier-threshold=N the VM back end runs each def as bytecode until
+/// it has been called N times, then queues it for the tier-up thread.  That
+/// thread compiles the def, with everything it calls, at the -O level into a
+/// module in its own LLVMContext, adds it to the JIT and stores the code in
+/// the def's FunctionEntry atomically.  The VM looks for the code on every
+/// call, so even a deep recursion already under way switches over at its
+/// next call.  A change to any function makes all of it stale, since callees
+/// are compiled in, and the counts start again from 0.  The switch must not
+/// be visible in the results, so CodegenExpr has to compute exactly what the
+/// VM does, down to comparisons with NaN.
+
+/// BuildFromCell - Convert V, a VM register, to a value of type Type.
+static LLVMValueRef BuildFromCell(LLVMValueRef V, int Type) {
+    if (Type == type_i64) {
+        return LLVMBuildBitCast(Builder, V, ValueTy(Type), "bits");
+    }
+    return BuildConvert(V, type_f64, Type);
+}
+
+/// BuildToCell - Convert V, of type Type, to a VM register.
+static LLVMValueRef BuildToCell(LLVMValueRef V, int Type) {
+    if (Type == type_i64) {
+        return LLVMBuildBitCast(Builder, V, DoubleTy, "cell");
+    }
+    return BuildConvert(V, Type, type_f64);
+}
+
+/// CodegenTierEntry - Emit Entry's function and everything it calls as
+/// internal functions, followed by
+///
+///   double NAME(const double *Args)
+///
+/// which calls it with its arguments and result held as VM registers.
+static LLVMValueRef CodegenTierEntry(const struct FunctionEntry *Entry,
+                                     const char *Name) {
+    const struct PrototypeAST *P = Entry->Proto;
+    LLVMValueRef Fn = CodegenFunction(Entry->Def, SymbolName(P->Name));
+    if (!Fn || !CodegenCallees(Entry->Def->Body)) {
+        return NULL;
+    }
+    LLVMSetLinkage(Fn, LLVMInternalLinkage);
+    
+    LLVMTypeRef DoublePtrTy = LLVMPointerType(DoubleTy, 0);
+    LLVMValueRef Tier = LLVMAddFunction(TheModule, Name,
+        LLVMFunctionType(DoubleTy, &DoublePtrTy, 1, 0));
+    LLVMValueRef Args = LLVMGetParam(Tier, 0);
+    LLVMPositionBuilderAtEnd(Builder,
+        LLVMAppendBasicBlockInContext(TheContext, Tier, "entry"));
+    
+    LLVMValueRef ArgsV[P->NumArgs + 1];
+    for (int i = 0; i < P->NumArgs; i++) {
+        LLVMValueRef Index = LLVMConstInt(LLVMInt32TypeInContext(TheContext), i, 0);
+        LLVMValueRef Ptr = LLVMBuildGEP2(Builder, DoubleTy, Args, &Index, 1,
+                                         "argptr");
+        ArgsV[i] = BuildFromCell(LLVMBuildLoad2(Builder, DoubleTy, Ptr, "arg"),
+                                 ArgType(P, i));
+    }
+    LLVMValueRef Result = LLVMBuildCall2(Builder, LLVMGlobalGetValueType(Fn),
+                                         Fn, ArgsV, P->NumArgs, "result");
+    LLVMBuildRet(Builder, BuildToCell(Result, P->RetType));
+    
+    if (LLVMVerifyFunction(Tier, LLVMPrintMessageAction)) {
+        return NULL;
+    }
+    return Tier;
+}
+
+/// TierUp - Compile Entry on the tier-up thread, into a module in TSC, and
+/// publish the code.  Nothing happens if Entry cannot be compiled as it is
+/// now, or already has current code.
+static void TierUp(struct FunctionEntry *Entry,
+                   LLVMOrcThreadSafeContextRef TSC) {
+    char Name[32];
+    snprintf(Name, sizeof(Name), "__tier.%d", Ctx->NumTierUps++);
+    
+    pthread_mutex_lock(&Ctx->DefLock);
+    int Generation = Ctx->DefGeneration;
+    const struct TierCode *Old = Entry->Tier;
+    int Ok = Entry->Def && !(Old && Old->Generation == Generation);
+    if (Ok) {
+        InitializeModule();
+        Ok = CodegenTierEntry(Entry, Name) != NULL;
+    }
+    pthread_mutex_unlock(&Ctx->DefLock);
+    
+    if (Ok) {
+        Ok = OptimizeModule(OptPipelines[Ctx->OptLevel]);
+    }
+    if (!Ok) {
+        if (TheModule) {
+            LLVMDisposeModule(TheModule);
+            TheModule = NULL;
+        }
+        return;
+    }
+    
+    LLVMOrcResourceTrackerRef RT =
+        LLVMOrcJITDylibCreateResourceTracker(Ctx->MainJD);
+    LLVMOrcThreadSafeModuleRef TSM =
+        LLVMOrcCreateNewThreadSafeModule(TheModule, TSC);
+    TheModule = NULL;
+    LLVMOrcExecutorAddress Addr;
+    LLVMErrorRef Err = LLVMOrcLLJITAddLLVMIRModuleWithRT(Ctx->TheJIT, RT, TSM);
+    if (Err || (Err = JITLookup(&Addr, Name))) {
+        ErrorLLVM(Err);
+        RemoveTracker(RT);
+        return;
+    }
+    
+    struct TierCode *T = (struct TierCode *) malloc(sizeof(struct TierCode));
+    T->Fn = (double (*)(const double *)) (uintptr_t) Addr;
+    T->Generation = Generation;
+    T->Tracker = RT;
+    T->NextRetired = NULL;
+    struct TierCode *Replaced =
+        __atomic_exchange_n(&Entry->Tier, T, __ATOMIC_ACQ_REL);
+    if (Replaced) {
+        // The main thread may still be running it.
+        pthread_mutex_lock(&Ctx->TierLock);
+        Replaced->NextRetired = Ctx->TierRetired;
+        Ctx->TierRetired = Replaced;
+        pthread_mutex_unlock(&Ctx->TierLock);
+    }
+}
+
+/// PopTierUp - Wait for the next queued function; NULL once the queue is
+/// closed.
+static struct FunctionEntry *PopTierUp() {
+    pthread_mutex_lock(&Ctx->TierLock);
+    while (Ctx->TierHead == Ctx->TierTail && !Ctx->TierClosed) {
+        pthread_cond_wait(&Ctx->TierAvailable, &Ctx->TierLock);
+    }
+    struct FunctionEntry *Entry = NULL;
+    if (!Ctx->TierClosed) {
+        Entry = Ctx->TierQueue[Ctx->TierHead++];
+        if (Ctx->TierHead == Ctx->TierTail) {
+            Ctx->TierHead = Ctx->TierTail = 0;
+        }
+    }
+    pthread_mutex_unlock(&Ctx->TierLock);
+    return Entry;
+}
+
+static void *TierWorkerMain(void *Arg) {
+    Ctx = (struct silly_context *) Arg;
+    IsCompileWorker = 1;
+    IsTierWorker = 1;
+    LLVMOrcThreadSafeContextRef TSC = LLVMOrcCreateNewThreadSafeContext();
+    TheContext = LLVMOrcThreadSafeContextGetContext(TSC);
+    Builder = LLVMCreateBuilderInContext(TheContext);
+    DoubleTy = LLVMDoubleTypeInContext(TheContext);
+    TheTargetMachine = CreateHostTargetMachine(LLVMRelocDefault,
+                                               LLVMCodeModelJITDefault);
+    
+    struct FunctionEntry *Entry;
+    while ((Entry = PopTierUp())) {
+        TierUp(Entry, TSC);
+    }
+    
+    LLVMDisposeBuilder(Builder);
+    if (TheTargetMachine) {
+        LLVMDisposeTargetMachine(TheTargetMachine);
+    }
+    LLVMOrcDisposeThreadSafeContext(TSC); // Modules in the JIT keep it alive.
+    return NULL;
+}
+
+/// QueueTierUp - Have the tier-up thread compile Entry, starting the thread
+/// the first time.
+static void QueueTierUp(struct FunctionEntry *Entry) {
+    pthread_mutex_lock(&Ctx->TierLock);
+    if (!Ctx->TierStarted) {
+        Ctx->TierStarted =
+            !pthread_create(&Ctx->TierThread, NULL, TierWorkerMain, Ctx);
+    }
+    if (Ctx->TierStarted) {
+        if (Ctx->TierTail == Ctx->TierCapacity) {
+            Ctx->TierCapacity = Ctx->TierCapacity ? Ctx->TierCapacity * 2 : 64;
+            Ctx->TierQueue = (struct FunctionEntry **) realloc(
+                Ctx->TierQueue, Ctx->TierCapacity * sizeof(*Ctx->TierQueue));
+        }
+        Ctx->TierQueue[Ctx->TierTail++] = Entry;
+        pthread_cond_signal(&Ctx->TierAvailable);
+    }
+    pthread_mutex_unlock(&Ctx->TierLock);
+}
+
+/// FreeRetiredTierCode - Free the code the tier-up thread has replaced.  It
+/// must only be called between items, when no code is running.
+static void FreeRetiredTierCode() {
+    pthread_mutex_lock(&Ctx->TierLock);
+    struct TierCode *T = Ctx->TierRetired;
+    Ctx->TierRetired = NULL;
+    pthread_mutex_unlock(&Ctx->TierLock);
+    while (T) {
+        struct TierCode *Next = T->NextRetired;
+        RemoveTracker(T->Tracker);
+        free(T);
+        T = Next;
+    }
+}
+
+/// StopTierWorker - Stop the tier-up thread, abandoning anything queued.
+static void StopTierWorker() {
+    if (!Ctx->TierStarted) {
+        return;
+    }
+    pthread_mutex_lock(&Ctx->TierLock);
+    Ctx->TierClosed = 1;
+    pthread_cond_broadcast(&Ctx->TierAvailable);
+    pthread_mutex_unlock(&Ctx->TierLock);
+    pthread_join(Ctx->TierThread, NULL);
+    Ctx->TierStarted = 0;
+}
+
+/// InitTiering - Let tiered code call any native function, whichever
+/// externs end up declaring them.
+static int InitTiering() {
+    for (int i = 0; Ctx->TierThreshold && i < NUM_NATIVE_FUNCTIONS; i++) {
+        if (!DefineNativeSymbol(&NativeFunctions[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+#pragma mark Library interface
+
+/// EnterContext - Make C the context of the calling thread, restoring the
+/// code generator state the thread had the last time it used C.
+static void EnterContext(struct silly_context *C) {
+    Ctx = C;
+    TheContext = C->MainContext;
+    TheModule = C->MainModule;
+    Builder = C->MainBuilder;
+    DoubleTy = C->MainDoubleTy;
+    TheTargetMachine = C->MainTargetMachine;
+}
+
+static void LeaveContext() {
+    Ctx->MainModule = TheModule;
+    Ctx = NULL;
+}
+
+void silly_default_options(struct silly_options *options) {
+    options->backend = silly_backend_jit;
+    options->opt_level = 2;
+    options->batch = 0;
+    options->jobs = 1;
+    options->cache_dir = NULL;
+    options->emit_obj = NULL;
+    options->emit_so = NULL;
+    options->on_result = NULL;
+    options->stats = 0;
+    options->flat_ast = 0;
+    options->inline_threshold = 16;
+    options->tier_threshold = 0;
+    options->user = NULL;
+}
+
+struct silly_context *silly_create(const struct silly_options *options) {
+    struct silly_context *C =
+        (struct silly_context *) calloc(1, sizeof(struct silly_context));
+    EnterContext(C);
+    C->Backend = options->backend;
+    C->FlatAST = options->flat_ast && C->Backend == silly_backend_tree;
+    C->OptLevel = options->opt_level;
+    C->EmitPath = options->emit_so ? options->emit_so : options->emit_obj;
+    C->EmitShared = options->emit_so != NULL;
+    C->BatchMode = options->batch || C->EmitPath;
+    C->NumJobs = options->jobs > 0 ? options->jobs : 1;
+    C->CacheDir = options->cache_dir;
+    C->InlineThreshold = options->inline_threshold;
+    C->TierThreshold =
+        C->Backend == silly_backend_vm ? options->tier_threshold : 0;
+    C->OnResult = options->on_result;
+    C->ResultUser = options->user;
+    C->CurArena = &C->ItemArena;
+    C->SourceFD = -1;
+    C->DefGeneration = 1;
+    C->Symbols = (struct SymbolTable *) calloc(1, sizeof(struct SymbolTable));
+    pthread_mutex_init(&C->Symbols->Lock, NULL);
+    if (options->stats) {
+        C->Stats = (struct Stats *) calloc(1, sizeof(struct Stats));
+        C->Stats->PhaseStart = StatsClock();
+    }
+    pthread_mutex_init(&C->WorkLock, NULL);
+    pthread_cond_init(&C->WorkAvailable, NULL);
+    pthread_mutex_init(&C->TierLock, NULL);
+    pthread_cond_init(&C->TierAvailable, NULL);
+    pthread_mutex_init(&C->DefLock, NULL);
+    pthread_mutex_init(&C->ParseLock, NULL);
+    pthread_cond_init(&C->FileParsed, NULL);
+    
+    // Install standard binary operators.
+    // 1 is lowest precedence.
+    C->BinopPrecedence['<'] = 10;
+    C->BinopPrecedence['+'] = 20;
+    C->BinopPrecedence['-'] = 30;
+    C->BinopPrecedence['*'] = 40; // highest.
+    
+    InitKeywords();
+    C->AnonExprSym = InternSymbol("__anon_expr", 11);
+    
+    if (C->EmitPath && C->Backend != silly_backend_jit) {
+        Error("Only the JIT back end can emit object files");
+        LeaveContext();
+        silly_destroy(C);
+        return NULL;
+    }
+    // Tiering starts in the VM but compiles hot defs with the JIT.
+    if ((C->Backend == silly_backend_jit || C->TierThreshold) &&
+        (!InitJIT() || !InitCompileCache() || !InitTiering())) {
+        LeaveContext();
+        silly_destroy(C);
+        return NULL;
+    }
+    C->UseCallSlots = C->Backend == silly_backend_jit && !C->BatchMode;
+    LeaveContext();
+    return C;
+}
+
+void silly_destroy(struct silly_context *C) {
+    EnterContext(C);
+    StopTierWorker();
+    FreeRetiredTierCode();
+    ReleaseSource();
+    for (int i = 0; i < MAX_SYMBOL_PAGES; i++) {
+        struct FunctionEntry *Page = C->FunctionPages[i];
+        for (int j = 0; Page && j < SYMBOL_PAGE_SIZE; j++) {
+            ArenaFree(&Page[j].Arena);
+            ArenaFree(&Page[j].InlineArena);
+            if (Page[j].Tracker) {
+                LLVMOrcReleaseResourceTracker(Page[j].Tracker);
+            }
+            if (Page[j].KernelTracker) {
+                LLVMOrcReleaseResourceTracker(Page[j].KernelTracker);
+            }
+            if (Page[j].Tier) {
+                LLVMOrcReleaseResourceTracker(Page[j].Tier->Tracker);
+                free(Page[j].Tier);
+            }
+        }
+        free(Page);
+        free(C->Symbols->Pages[i]);
+    }
+    
+    if (TheModule) {
+        LLVMDisposeModule(TheModule);
+        TheModule = NULL;
+    }
+    if (C->TheJIT) {
+        LLVMOrcDisposeLLJIT(C->TheJIT);
+    }
+    if (C->MainBuilder) {
+        LLVMDisposeBuilder(C->MainBuilder);
+    }
+    if (C->TheTSContext) {
+        LLVMOrcDisposeThreadSafeContext(C->TheTSContext);
+    }
+    if (C->MainTargetMachine) {
+        LLVMDisposeTargetMachine(C->MainTargetMachine);
+    }
+    
+    ArenaFree(&C->ItemArena);
+    ArenaFree(&C->PersistentArena);
+    ArenaFree(&C->DefArena);
+    ArenaFree(&C->Symbols->Names);
+    free(C->Symbols->Buckets);
+    pthread_mutex_destroy(&C->Symbols->Lock);
+    free(C->Symbols);
+    free(C->CodeBuf);
+    free(C->ConstBuf);
+    free(C->CalleeBuf);
+    free(C->ArgStack);
+    free(C->ParamBuf);
+    free(C->ParamTypeBuf);
+    free(C->WorkQueue);
+    free(C->TierQueue);
+    free(C->BatchExprPure);
+    free(C->PureVisited);
+    free(C->Stats);
+    pthread_mutex_destroy(&C->WorkLock);
+    pthread_cond_destroy(&C->WorkAvailable);
+    pthread_mutex_destroy(&C->TierLock);
+    pthread_cond_destroy(&C->TierAvailable);
+    pthread_mutex_destroy(&C->DefLock);
+    pthread_mutex_destroy(&C->ParseLock);
+    pthread_cond_destroy(&C->FileParsed);
+    LeaveContext();
+    free(C);
+}
+
+/// BeginSource - Get ready to run a new source; in batch mode that means
+/// starting on a new module.
+static void BeginSource() {
+    if (Ctx->BatchMode && Ctx->Backend == silly_backend_jit) {
+        InitializeModule();
+        Ctx->FirstBatchExpr = Ctx->NumBatchExprs;
+        Ctx->FirstEmitError = Ctx->NumErrors;
+        if (Ctx->NumJobs > 1) {
+            Ctx->UseCompileWorkers = 1;
+            StartCompileWorkers();
+        }
+    }
+}
+
+/// EndSource - Finish off a source once all of it has been handled,
+/// compiling and running or emitting the batch in batch mode.  Returns 0 if
+/// the batch failed.
+static int EndSource() {
+    int Ok = 1;
+    if (Ctx->UseCompileWorkers) {
+        enum Phase Prev = EnterPhase(phase_codegen);
+        Ok = FinishCompileWorkers();
+        EnterPhase(Prev);
+        Ctx->UseCompileWorkers = 0;
+    }
+    if (Ctx->BatchMode && Ctx->Backend == silly_backend_jit) {
+        Ok = Ok && (Ctx->EmitPath ? EmitBatch() : RunBatch());
+        if (TheModule) {
+            LLVMDisposeModule(TheModule);
+            TheModule = NULL;
+        }
+    }
+    return Ok;
+}
+
+/// RunSource - Run everything in the current source.  Returns 0 if the
+/// batch failed.
+static int RunSource() {
+    BeginSource();
+    
+    // Prime the first token.
+    if (Ctx->Interactive) {
+        fprintf(stderr, "ready> ");
+    }
+    getNextToken();
+    
+    // Run the main "interpreter loop" now.
+    MainLoop();
+    return EndSource();
+}
+
+/// RunFiles - Run the files at Paths as one source, parsed ahead by parse
+/// workers.  Returns 0 if a file could not be opened or the batch failed.
+static int RunFiles(const char *const *Paths, int NumFiles) {
+    BeginSource();
+    StartParseWorkers(Paths, NumFiles);
+    int Ok = 1;
+    for (int i = 0; i < NumFiles; i++) {
+        Ok &= HandleParsedFile(&Ctx->ParsedFiles[i]);
+    }
+    FinishParseWorkers();
+    Ok = EndSource() && Ok;
+    FreeParsedFiles();
+    return Ok;
+}
+
+int silly_run_file(struct silly_context *C, const char *path) {
+    EnterContext(C);
+    int Ok = 1;
+    if (!path) {
+        InitSourceFD(STDIN_FILENO);
+    } else if (!InitSourceFile(path)) {
+        fprintf(stderr, "Error: could not open %s\n", path);
+        Ok = 0;
+    }
+    if (Ok) {
+        C->Interactive = !C->BatchMode;
+        Ok = RunSource();
+        C->Interactive = 0;
+    }
+    LeaveContext();
+    return Ok;
+}
+
+int silly_run_files(struct silly_context *C, const char *const paths[], int n) {
+    if (n <= 1) {
+        return silly_run_file(C, n ? paths[0] : NULL);
+    }
+    EnterContext(C);
+    int Ok = RunFiles(paths, n);
+    LeaveContext();
+    return Ok;
+}
+
+int silly_eval(struct silly_context *C, const char *source, size_t len,
+               double *result) {
+    EnterContext(C);
+    InitSourceString(source, len);
+    int NumErrors = C->NumErrors;
+    C->ResultOut = result;
+    int Ok = RunSource() && C->NumErrors == NumErrors;
+    C->ResultOut = NULL;
+    LeaveContext();
+    return Ok;
+}
+
+/// BeginPush - Start a push mode session, if there isn't one already.
+static void BeginPush() {
+    if (!Ctx->Pushing) {
+        InitSourcePush();
+        BeginSource();
+        Ctx->SkipToken = 1; // Prime the first token.
+    }
+}
+
+int silly_push(struct silly_context *C, const char *chunk, size_t len) {
+    EnterContext(C);
+    BeginPush();
+    int NumErrors = C->NumErrors;
+    PushSource(chunk, len);
+    RunPushedItems();
+    int Ok = C->NumErrors == NumErrors;
+    LeaveContext();
+    return Ok;
+}
+
+int silly_push_end(struct silly_context *C) {
+    EnterContext(C);
+    BeginPush();
+    int NumErrors = C->NumErrors;
+    C->PushEnded = 1;
+    RunPushedItems();
+    int Ok = EndSource() && C->NumErrors == NumErrors;
+    ReleaseSource();
+    LeaveContext();
+    return Ok;
+}
+
+void silly_print_stats(struct silly_context *C) {
+    EnterContext(C);
+    if (C->Stats) {
+        PrintStats();
+    }
+    LeaveContext();
+}
+
+int silly_eval_batch(struct silly_context *C, const char *fn,
+                     const double *args[], double *out, size_t n) {
+    EnterContext(C);
+    struct FunctionEntry *Entry = FindFunctionEntry(InternSymbol(fn, strlen(fn)));
+    int Ok;
+    if (!Entry || !Entry->Proto) {
+        Ok = 0;
+        Error("Unknown function referenced");
+    } else if (C->Backend != silly_backend_jit) {
+        enum Phase Prev = EnterPhase(phase_execute);
+        Ok = EvalBatch(Entry, args, out, n);
+        EnterPhase(Prev);
+    } else if ((Ok = GetKernel(Entry, SymbolName(Entry->Proto->Name)))) {
+        enum Phase Prev = EnterPhase(phase_execute);
+        Entry->Kernel(args, out, n);
+        EnterPhase(Prev);
+    }
+    LeaveContext();
+    return Ok;
+}
@@ -0,0 +1,103 @@
+#ifndef SILLY_H
+#define SILLY_H
+
+#include <stddef.h>
+
+/// The embedding interface of the Silly Kaleidoscope compiler.  All state
+/// lives in a silly_context; contexts are independent of each other and may
+/// be used from different threads at the same time, but each one only from a
+/// single thread at a time.  Errors are reported on stderr as they happen.
+
+/// silly_backend - How definitions and top-level expressions are executed.
+enum silly_backend {
+    silly_backend_jit,  // Compile to native code with LLVM.
+    silly_backend_tree, // Walk the AST directly.
+    silly_backend_vm    // Compile to bytecode and run it on the register VM.
+};
+
+/// silly_options - How a context compiles and runs code.
+struct silly_options {
+    enum silly_backend backend;
+    int opt_level;         // -O level for the JIT, 0 to 3.
+    int batch;             // Batch mode, as for -c.
+    int jobs;              // Batch compile, parse and run threads, as for -jN.
+    const char *cache_dir; // Object cache for the JIT, as for --cache-dir.
+    
+    // Compile the defs ahead of time into this object file or shared library,
+    // as for --emit-obj and --emit-so, instead of running anything; implies
+    // batch mode and needs the JIT back end.  silly_run_file and friends
+    // write it once the source is exhausted, unless there were errors.
+    const char *emit_obj;
+    const char *emit_so;
+    int stats;             // Collect statistics for silly_print_stats.
+    int flat_ast;          // Evaluate flattened ASTs, as for --flat-ast.
+    int inline_threshold;  // Inline calls to smaller defs; 0 disables it.
+    int tier_threshold;    // VM calls before a def is JIT'd; 0 disables it.
+    
+    // Called with the value of each top-level expression instead of printing
+    // it, if set.  silly_eval stores values in its result instead.
+    void (*on_result)(void *user, double value);
+    void *user;
+};
+
+struct silly_context;
+
+/// silly_default_options - The JIT at -O2, outside batch mode, uncached,
+/// inlining defs of up to 16 nodes, and the VM without tiering.
+void silly_default_options(struct silly_options *options);
+
+/// silly_create - A new context, or NULL if the JIT could not be set up.
+struct silly_context *silly_create(const struct silly_options *options);
+
+void silly_destroy(struct silly_context *context);
+
+/// silly_run_file - Run the file at path, or standard input if path is NULL,
+/// as the command line does: interactively with prompts, or printing the
+/// value of each top-level expression to stdout in batch mode.  Returns 0 if
+/// the file could not be opened or a batch could not be compiled or emitted.
+int silly_run_file(struct silly_context *context, const char *path);
+
+/// silly_run_files - Run the n files at paths as a single source, as if
+/// they were one file: in batch mode they make one module.  Up to jobs of
+/// the files are lexed and parsed at a time on threads of their own, while
+/// the calling thread runs each file's items, in order, once it has been
+/// parsed; no prompts or status messages are printed.  A file that cannot be
+/// opened is reported as an error and the rest are still run.  With one
+/// path, or none for standard input, this is silly_run_file.  Returns 0 if a
+/// file could not be opened or the batch could not be compiled or emitted.
+int silly_run_files(struct silly_context *context, const char *const paths[],
+                    int n);
+
+/// silly_eval - Run the len bytes of Kaleidoscope at source without printing
+/// anything but errors.  The value of the last top-level expression is stored
+/// in *result, if there is one.  Returns 0 if any error was reported.
+int silly_eval(struct silly_context *context, const char *source, size_t len,
+               double *result);
+
+/// silly_push - Feed the next chunk of a program arriving piecemeal, such
+/// as from a socket; chunks may split tokens anywhere.  Each item is run as
+/// soon as the chunks pushed so far complete it, and its value reported as
+/// silly_run_file would without prompts or status messages.  An expression
+/// is only complete once the token after it, such as a ';', has arrived.
+/// Returns 0 if any error was reported.
+int silly_push(struct silly_context *context, const char *chunk, size_t len);
+
+/// silly_push_end - Mark the end of the pushed program and run whatever it
+/// still holds.  The next silly_push starts a new program; the context must
+/// not otherwise be used between a silly_push and its silly_push_end.
+/// Returns 0 if any error was reported or a batch could not be compiled.
+int silly_push_end(struct silly_context *context);
+
+/// silly_eval_batch - Set out[i] = fn(args[0][i], args[1][i], ...) for each
+/// i < n, where args holds one column per argument of fn.  Returns 0 after
+/// reporting an error if fn is not defined or a call fails.
+int silly_eval_batch(struct silly_context *context, const char *fn,
+                     const double *args[], double *out, size_t n);
+
+/// silly_print_stats - Report on stderr the time spent so far in each phase
+/// (lexing, parsing, codegen, optimization, JIT compilation and execution),
+/// the number of AST nodes of each kind and the bytes allocated for them, as
+/// for --stats.  Does nothing unless the stats option was set.
+void silly_print_stats(struct silly_context *context);
+
+#endif
@@ -0,0 +1,388 @@
+// Micro-benchmarks for the lexer, the parser and each back end.  The whole
+// compiler is built into this file so that gettok and the parser, which are
+// internal to it, can be timed on their own.
+#include "../Silly/silly.c"
+
+#include <stdarg.h>
+#include <time.h>
+
+#pragma mark Synthetic sources
+
+/// Text - A growable string the generators append to.
+struct Text {
+    char *Data;
+    size_t Len, Cap;
+};
+
+static void Append(struct Text *T, const char *Format, ...) {
+    va_list Ap;
+    while (1) {
+        va_start(Ap, Format);
+        int N = vsnprintf(T->Data + T->Len, T->Cap - T->Len, Format, Ap);
+        va_end(Ap);
+        if (T->Data && T->Len + N < T->Cap) {
+            T->Len += N;
+            return;
+        }
+        T->Cap = T->Cap ? 2 * T->Cap : 64 * 1024;
+        T->Data = (char *) realloc(T->Data, T->Cap);
+    }
+}
+
+static const char Ops[] = "+-*<";
+
+/// GenerateDeep - Expressions nested DEEP_DEPTH parentheses deep:
+/// 1 + (2 - (3 * (... < (0)))).
+#define DEEP_DEPTH 200
+static void GenerateDeep(struct Text *T) {
+    for (int i = 0; i < 500; i++) {
+        for (int j = 0; j < DEEP_DEPTH; j++) {
+            Append(T, "%d %c (", j + 1, Ops[j % 4]);
+        }
+        Append(T, "x");
+        for (int j = 0; j < DEEP_DEPTH; j++) {
+            Append(T, ")");
+        }
+        Append(T, ";\n");
+    }
+}
+
+/// GenerateChain - Long runs of binary operators with mixed precedence,
+/// which exercise operator precedence parsing rather than recursion.
+static void GenerateChain(struct Text *T) {
+    for (int i = 0; i < 500; i++) {
+        Append(T, "x");
+        for (int j = 0; j < 200; j++) {
+            Append(T, " %c %d.5", Ops[(i + j) % 4], j);
+        }
+        Append(T, ";\n");
+    }
+}
+
+/// GenerateWide - Calls with WIDE_ARGS arguments each.
+#define WIDE_ARGS 48
+static void GenerateWide(struct Text *T) {
+    for (int i = 0; i < 2000; i++) {
+        Append(T, "f%d(", i % 100);
+        for (int j = 0; j < WIDE_ARGS; j++) {
+            Append(T, j ? ", a%d + %d" : "a%d + %d", j, i);
+        }
+        Append(T, ");\n");
+    }
+}
+
+/// GenerateDefs - Many small definitions.
+static void GenerateDefs(struct Text *T) {
+    for (int i = 0; i < 5000; i++) {
+        Append(T, "def f%d(a b c) a * %d + b * c - (a < b);\n", i, i);
+    }
+}
+
+/// GenerateNumbers - Tables of literals with many digits, like the data that
+/// scripts embed.  Each line folds to a single node, so parsing it is timed
+/// in bytes rather than nodes.
+static void GenerateNumbers(struct Text *T) {
+    for (int i = 0; i < 500; i++) {
+        Append(T, "%d.%06d", i, i * 7919 % 1000000);
+        for (int j = 1; j < 100; j++) {
+            int K = i * 100 + j;
+            Append(T, " + %.*f", 1 + K % 17, (K * 2654435761u % 100000) * 0.0137);
+        }
+        Append(T, ";\n");
+    }
+}
+
+struct Workload {
+    const char *Name;
+    void (*Generate)(struct Text *T);
+    int Folds; // Built mostly of literals, which the parser folds away.
+    struct Text Source;
+};
+
+static struct Workload Workloads[] = {
+    { "deep", GenerateDeep, 0, { NULL, 0, 0 } },
+    { "chain", GenerateChain, 0, { NULL, 0, 0 } },
+    { "wide", GenerateWide, 0, { NULL, 0, 0 } },
+    { "defs", GenerateDefs, 0, { NULL, 0, 0 } },
+    { "numbers", GenerateNumbers, 1, { NULL, 0, 0 } },
+};
+
+#define NUM_WORKLOADS ((int) (sizeof(Workloads) / sizeof(Workloads[0])))
+
+#pragma mark Timing
+
+static double MinTime = 0.5; // Seconds each benchmark runs for at least.
+static const char *Filter;   // Only run benchmarks whose name contains this.
+
+static double Now() {
+    struct timespec Ts;
+    clock_gettime(CLOCK_MONOTONIC, &Ts);
+    return Ts.tv_sec + Ts.tv_nsec * 1e-9;
+}
+
+/// Measure - Call Run(Arg) until MinTime has passed.  Returns the average
+/// time per call in seconds.
+static double Measure(void (*Run)(void *), void *Arg) {
+    Run(Arg); // Warm up.
+    long Iters = 0;
+    double Start = Now(), Elapsed;
+    do {
+        Run(Arg);
+        Iters++;
+    } while ((Elapsed = Now() - Start) < MinTime);
+    return Elapsed / Iters;
+}
+
+static int Selected(const char *Name) {
+    return !Filter || strstr(Name, Filter);
+}
+
+static void Report(const char *Name, double Rate, const char *Unit) {
+    const char *Scale = "";
+    if (Rate >= 1e9) {
+        Rate /= 1e9, Scale = "G";
+    } else if (Rate >= 1e6) {
+        Rate /= 1e6, Scale = "M";
+    } else if (Rate >= 1e3) {
+        Rate /= 1e3, Scale = "k";
+    }
+    printf("%-24s %10.2f %s%s/s\n", Name, Rate, Scale, Unit);
+    fflush(stdout);
+}
+
+#pragma mark Lexer and parser
+
+static struct silly_context *FrontEnd; // For the lexer and parser alone.
+
+/// LexAll - Run gettok over the whole of a workload.
+static long LexAll(struct Workload *W) {
+    InitSourceString(W->Source.Data, W->Source.Len);
+    long NumTokens = 0;
+    while (gettok() != tok_eof) {
+        NumTokens++;
+    }
+    return NumTokens;
+}
+
+static void RunLex(void *Arg) {
+    LexAll((struct Workload *) Arg);
+}
+
+static long CountNodes(const struct ExprAST *E) {
+    switch (E->Kind) {
+        case expr_binary: {
+            const struct BinaryExprAST *B = (const struct BinaryExprAST *) E;
+            return 1 + CountNodes(B->LHS) + CountNodes(B->RHS);
+        }
+        case expr_call: {
+            const struct CallExprAST *C = (const struct CallExprAST *) E;
+            long N = 1;
+            for (int i = 0; i < C->NumArgs; i++) {
+                N += CountNodes(C->Args[i]);
+            }
+            return N;
+        }
+        case expr_if: {
+            const struct IfExprAST *If = (const struct IfExprAST *) E;
+            return 1 + CountNodes(If->Cond) + CountNodes(If->Then) +
+                   CountNodes(If->Else);
+        }
+        case expr_for: {
+            const struct ForExprAST *For = (const struct ForExprAST *) E;
+            return 1 + CountNodes(For->Start) + CountNodes(For->End) +
+                   (For->Step ? CountNodes(For->Step) : 0) +
+                   CountNodes(For->Body);
+        }
+        case expr_cast:
+            return 1 + CountNodes(((const struct CastExprAST *) E)->Operand);
+        default:
+            return 1;
+    }
+}
+
+/// ParseAll - Parse every item of a workload with ParseExpression, or
+/// ParseDefinition for defs, and return how many nodes were built.
+static long ParseAll(struct Workload *W) {
+    InitSourceString(W->Source.Data, W->Source.Len);
+    long NumNodes = 0;
+    getNextToken();
+    while (Ctx->CurTok != tok_eof) {
+        struct ExprAST *E;
+        if (Ctx->CurTok == ';') {
+            getNextToken();
+            continue;
+        } else if (Ctx->CurTok == tok_def) {
+            struct FunctionAST *F = ParseDefinition();
+            E = F ? F->Body : NULL;
+        } else {
+            E = ParseExpression();
+        }
+        if (!E) {
+            fprintf(stderr, "Error: %s does not parse\n", W->Name);
+            exit(1);
+        }
+        NumNodes += CountNodes(E);
+        ArenaReset(&Ctx->ItemArena);
+    }
+    return NumNodes;
+}
+
+static void RunParse(void *Arg) {
+    ParseAll((struct Workload *) Arg);
+}
+
+static void BenchFrontEnd() {
+    struct silly_options Options;
+    silly_default_options(&Options);
+    Options.backend = silly_backend_tree;
+    FrontEnd = silly_create(&Options);
+    EnterContext(FrontEnd);
+    
+    char Name[64];
+    for (int i = 0; i < NUM_WORKLOADS; i++) {
+        struct Workload *W = &Workloads[i];
+        snprintf(Name, sizeof(Name), "lex/%s", W->Name);
+        if (Selected(Name)) {
+            long NumTokens = LexAll(W);
+            double Time = Measure(RunLex, W);
+            Report(Name, NumTokens / Time, "tokens");
+            snprintf(Name, sizeof(Name), "lex/%s/bytes", W->Name);
+            Report(Name, W->Source.Len / Time, "B");
+        }
+    }
+    for (int i = 0; i < NUM_WORKLOADS; i++) {
+        struct Workload *W = &Workloads[i];
+        snprintf(Name, sizeof(Name), "parse/%s", W->Name);
+        if (Selected(Name) && W->Folds) {
+            ParseAll(W);
+            snprintf(Name, sizeof(Name), "parse/%s/bytes", W->Name);
+            Report(Name, W->Source.Len / Measure(RunParse, W), "B");
+        } else if (Selected(Name)) {
+            long NumNodes = ParseAll(W);
+            Report(Name, NumNodes / Measure(RunParse, W), "nodes");
+        }
+    }
+    
+    LeaveContext();
+    silly_destroy(FrontEnd);
+}
+
+#pragma mark Evaluation
+
+/// EVAL_PRELUDE - The functions each back end evaluates.
+#define EVAL_PRELUDE \
+    "def poly(x y) x * x * 3 + x * y * 2 - y + 1;\n" \
+    "def mix(x y) poly(x, y) * poly(y, x) - (x < y) * poly(x + 1, y);\n"
+
+#define NUM_TUPLES 100000
+#define NUM_EXPRS 200
+
+struct EvalBench {
+    struct silly_context *Context;
+    const double *Columns[2];
+    double *Out;
+    struct Text Exprs;
+};
+
+static void RunCalls(void *Arg) {
+    struct EvalBench *B = (struct EvalBench *) Arg;
+    if (!silly_eval_batch(B->Context, "mix", B->Columns, B->Out, NUM_TUPLES)) {
+        exit(1);
+    }
+}
+
+static void RunExprs(void *Arg) {
+    struct EvalBench *B = (struct EvalBench *) Arg;
+    double Result;
+    if (!silly_eval(B->Context, B->Exprs.Data, B->Exprs.Len, &Result)) {
+        exit(1);
+    }
+}
+
+/// BenchEval - Time a back end on calls through silly_eval_batch, where the
+/// JIT compiles its kernel once up front, and on separate top-level
+/// expressions through silly_eval, where every one is compiled on its own.
+/// With TierThreshold set the VM hands hot defs to the JIT as it goes.
+static void BenchEval(enum silly_backend Backend, int FlatAST,
+                      int TierThreshold, const char *BackendName) {
+    char CallsName[64], ExprsName[64];
+    snprintf(CallsName, sizeof(CallsName), "eval/%s/calls", BackendName);
+    snprintf(ExprsName, sizeof(ExprsName), "eval/%s/exprs", BackendName);
+    if (!Selected(CallsName) && !Selected(ExprsName)) {
+        return;
+    }
+    
+    struct silly_options Options;
+    silly_default_options(&Options);
+    Options.backend = Backend;
+    Options.flat_ast = FlatAST;
+    Options.tier_threshold = TierThreshold;
+    struct EvalBench B;
+    memset(&B, 0, sizeof(B));
+    B.Context = silly_create(&Options);
+    if (!B.Context ||
+        !silly_eval(B.Context, EVAL_PRELUDE, strlen(EVAL_PRELUDE), NULL)) {
+        exit(1);
+    }
+    
+    double *X = (double *) malloc(NUM_TUPLES * sizeof(double));
+    double *Y = (double *) malloc(NUM_TUPLES * sizeof(double));
+    B.Out = (double *) malloc(NUM_TUPLES * sizeof(double));
+    for (int i = 0; i < NUM_TUPLES; i++) {
+        X[i] = i * 0.25;
+        Y[i] = (NUM_TUPLES - i) * 0.5;
+    }
+    B.Columns[0] = X;
+    B.Columns[1] = Y;
+    for (int i = 0; i < NUM_EXPRS; i++) {
+        Append(&B.Exprs, "mix(%d, %d);\n", i, NUM_EXPRS - i);
+    }
+    
+    if (Selected(CallsName)) {
+        Report(CallsName, NUM_TUPLES / Measure(RunCalls, &B), "evals");
+    }
+    if (Selected(ExprsName)) {
+        Report(ExprsName, NUM_EXPRS / Measure(RunExprs, &B), "evals");
+    }
+    
+    free(X);
+    free(Y);
+    free(B.Out);
+    free(B.Exprs.Data);
+    silly_destroy(B.Context);
+}
+
+#pragma mark Driver
+
+static int Usage() {
+    fprintf(stderr, "usage: SillyBench [--time=SECONDS] [filter]\n");
+    return 1;
+}
+
+int main(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        if (!strncmp(argv[i], "--time=", 7) && atof(argv[i] + 7) > 0) {
+            MinTime = atof(argv[i] + 7);
+        } else if (argv[i][0] == '-' || Filter) {
+            return Usage();
+        } else {
+            Filter = argv[i];
+        }
+    }
+    
+    for (int i = 0; i < NUM_WORKLOADS; i++) {
+        Workloads[i].Generate(&Workloads[i].Source);
+    }
+    
+    BenchFrontEnd();
+    BenchEval(silly_backend_tree, 0, 0, "tree");
+    BenchEval(silly_backend_tree, 1, 0, "flat");
+    BenchEval(silly_backend_vm, 0, 0, "vm");
+    BenchEval(silly_backend_vm, 0, 1000, "tiered");
+    BenchEval(silly_backend_jit, 0, 0, "jit");
+    
+    for (int i = 0; i < NUM_WORKLOADS; i++) {
+        free(Workloads[i].Source.Data);
+    }
+    return 0;
+}
@@ -0,0 +1,35 @@
+#!/bin/sh
+# Build Silly and SillyBench without Xcode: ./build.sh [silly|bench|all]...
+# CC, CFLAGS, LLVM_CONFIG and OUT (the output directory, build by default)
+# override the defaults.
+set -e
+
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O2}
+LLVM_CONFIG=${LLVM_CONFIG:-llvm-config}
+OUT=${OUT:-build}
+
+LLVM_CFLAGS=$($LLVM_CONFIG --cflags)
+LLVM_LIBS="$($LLVM_CONFIG --ldflags --libs core orcjit native) $($LLVM_CONFIG --system-libs)"
+
+silly() {
+    $CC -std=gnu99 $CFLAGS -pthread $LLVM_CFLAGS Silly/main.c Silly/silly.c \
+        -o "$OUT/silly" $LLVM_LIBS -lm
+}
+
+bench() {
+    $CC -std=gnu99 $CFLAGS -pthread $LLVM_CFLAGS SillyBench/bench.c \
+        -o "$OUT/silly-bench" $LLVM_LIBS -lm
+}
+
+cd "$(dirname "$0")"
+mkdir -p "$OUT"
+[ $# -gt 0 ] || set -- all
+for Target in "$@"; do
+    case "$Target" in
+        silly) silly ;;
+        bench) bench ;;
+        all) silly; bench ;;
+        *) echo "usage: $0 [silly|bench|all]..." >&2; exit 1 ;;
+    esac
+done